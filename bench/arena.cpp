@@ -0,0 +1,87 @@
+#include "bench/bench.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+
+static std::size_t allocations = 0;
+
+void *operator new(std::size_t size)
+{
+    ++allocations;
+    void *result = std::malloc(size ? size : 1);
+    if (!result) {
+        throw std::bad_alloc();
+    }
+    return result;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+
+/**
+ * One file with @a count include directives; their paths are the strings a
+ * parsed program interns.
+ */
+static std::string many_directives(unsigned int count)
+{
+    std::string source("#version 330 core\n");
+    for (unsigned int i = 0; i < count; ++i) {
+        source += "uniform vec4 value_" + std::to_string(i) + ";\n";
+        source += "{% include \"lib/path/to/include_" + std::to_string(i) + ".glsl\" %}\n";
+    }
+    return source;
+}
+
+static void run(const char *name, std::size_t arena_block_size,
+                unsigned int rounds)
+{
+    const std::string source = many_directives(4096);
+    auto buffer = std::make_shared<spp::SourceBuffer>(source.data(), source.size());
+
+    std::size_t sections = 0;
+    std::size_t arena_used = 0;
+    std::size_t arena_reserved = 0;
+    const std::size_t allocations_before = allocations;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    for (unsigned int round = 0; round < rounds; ++round) {
+        spp::ParserContext context(buffer);
+        context.set_arena_block_size(arena_block_size);
+        std::unique_ptr<spp::Program> prog(context.parse());
+        if (!prog || !prog->errors().empty()) {
+            std::cerr << "failed to parse benchmark program" << std::endl;
+            std::exit(1);
+        }
+        sections = prog->size();
+        arena_used = prog->arena() ? prog->arena()->bytes_used() : 0;
+        arena_reserved = prog->arena() ? prog->arena()->bytes_reserved() : 0;
+    }
+
+    const auto t1 = std::chrono::steady_clock::now();
+    const double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+    std::cout << name << ": "
+              << sections << " sections, "
+              << (ms / rounds) << " ms/round, "
+              << ((allocations - allocations_before) / rounds) << " allocations/round, "
+              << arena_used << "/" << arena_reserved << " arena bytes used/reserved"
+              << std::endl;
+}
+
+void bench_arena(unsigned int rounds)
+{
+    run("heap", 0, rounds);
+    run("arena", 16384, rounds);
+}
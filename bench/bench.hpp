@@ -0,0 +1,45 @@
+#ifndef SPP_BENCH_H
+#define SPP_BENCH_H
+
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "spp/spp.hpp"
+
+
+class MemoryLoader: public spp::Loader
+{
+private:
+    std::unordered_map<std::string, std::string> m_files;
+
+public:
+    void add_source(const std::string &path, const std::string &source)
+    {
+        m_files[path] = source;
+    }
+
+    std::unique_ptr<std::istream> open(const std::string &path) override
+    {
+        auto iter = m_files.find(path);
+        if (iter == m_files.end()) {
+            return nullptr;
+        }
+
+        return std::make_unique<std::istringstream>(iter->second);
+    }
+};
+
+/**
+ * Build a tree of files where each file has @a fanout includes interleaved
+ * with static source, down to @a depth levels.
+ */
+void add_tree(MemoryLoader &loader,
+              const std::string &path,
+              unsigned int depth,
+              unsigned int fanout);
+
+void bench_arena(unsigned int rounds);
+void bench_includes(unsigned int rounds);
+
+#endif
@@ -0,0 +1,96 @@
+#include "bench/bench.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+
+/**
+ * One file including a small header @a width times.
+ */
+static std::unique_ptr<MemoryLoader> wide_tree(unsigned int width)
+{
+    auto loader = std::make_unique<MemoryLoader>();
+    loader->add_source("leaf", "#version 330 core\n"
+                               "uniform vec4 leaf_value;\n");
+
+    std::string source("#version 330 core\n");
+    for (unsigned int i = 0; i < width; ++i) {
+        source += "float value_" + std::to_string(i) + ";\n";
+        source += "{% include \"leaf\" %}\n";
+    }
+    loader->add_source("root", source);
+    return loader;
+}
+
+/**
+ * A binary include tree @a depth levels deep.
+ */
+static std::unique_ptr<MemoryLoader> deep_tree(unsigned int depth)
+{
+    auto loader = std::make_unique<MemoryLoader>();
+    add_tree(*loader, "root", depth, 2);
+    return loader;
+}
+
+/**
+ * Number of sections of @a prog after expanding lazy includes.
+ */
+static std::size_t expanded_size(const spp::Program &prog)
+{
+    std::size_t result = 0;
+    for (auto iter = prog.cbegin(); iter != prog.cend(); ++iter) {
+        if (iter->kind() == spp::SectionKind::INCLUDED_PROGRAM) {
+            result += expanded_size(*iter->program()) - 1;
+        } else {
+            result += 1;
+        }
+    }
+    return result;
+}
+
+static void run(const char *name,
+                unsigned int size,
+                std::unique_ptr<MemoryLoader> (*make_loader)(unsigned int),
+                bool lazy,
+                unsigned int rounds)
+{
+    std::size_t sections = 0;
+    double ms = 0;
+
+    for (unsigned int round = 0; round < rounds; ++round) {
+        spp::Library library(make_loader(size));
+        library.set_max_include_depth(64);
+        library.set_lazy_includes(lazy);
+
+        const auto t0 = std::chrono::steady_clock::now();
+        const spp::Program *prog = library.load("root");
+        const auto t1 = std::chrono::steady_clock::now();
+        ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+        if (!prog || !prog->errors().empty()) {
+            std::cerr << "failed to load benchmark tree" << std::endl;
+            std::exit(1);
+        }
+        sections = expanded_size(*prog);
+    }
+
+    ms /= rounds;
+    std::cout << name << " " << size << (lazy ? " lazy" : " eager") << ": "
+              << sections << " sections, "
+              << ms << " ms/round, "
+              << (ms * 1e6 / sections) << " ns/section"
+              << std::endl;
+}
+
+void bench_includes(unsigned int rounds)
+{
+    for (bool lazy: {false, true}) {
+        for (unsigned int width: {1000, 4000, 16000}) {
+            run("wide", width, &wide_tree, lazy, rounds);
+        }
+        for (unsigned int depth: {8, 10, 12}) {
+            run("deep", depth, &deep_tree, lazy, rounds);
+        }
+    }
+}
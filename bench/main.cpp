@@ -0,0 +1,42 @@
+#include "bench/bench.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+
+void add_tree(MemoryLoader &loader,
+              const std::string &path,
+              unsigned int depth,
+              unsigned int fanout)
+{
+    std::string source("#version 330 core\n");
+    for (unsigned int i = 0; i < fanout; ++i) {
+        source += "uniform vec4 value_" + std::to_string(i) + ";\n";
+        if (depth > 0) {
+            const std::string child = path + "_" + std::to_string(i);
+            source += "{% include \"" + child + "\" %}\n";
+            add_tree(loader, child, depth-1, fanout);
+        }
+    }
+    loader.add_source(path, source);
+}
+
+int main(int argc, char **argv)
+{
+    const char *which = argc > 1 ? argv[1] : "all";
+    unsigned int rounds = 10;
+    if (argc > 2) {
+        rounds = std::max(1, std::atoi(argv[2]));
+    }
+
+    if (!std::strcmp(which, "all") || !std::strcmp(which, "arena")) {
+        bench_arena(rounds);
+    }
+    if (!std::strcmp(which, "all") || !std::strcmp(which, "includes")) {
+        bench_includes(rounds);
+    }
+
+    return 0;
+}
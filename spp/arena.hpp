@@ -0,0 +1,84 @@
+#ifndef SPP_ARENA_H
+#define SPP_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+namespace spp {
+
+/**
+ * Monotonic bump allocator.
+ *
+ * Memory is handed out from large blocks and only released, all at once,
+ * when the arena is destroyed. Destructors of objects created in the arena
+ * are not called by the arena.
+ *
+ * An arena is not thread-safe.
+ */
+class Arena
+{
+public:
+    explicit Arena(std::size_t block_size = 16384);
+    Arena(const Arena &ref) = delete;
+    Arena &operator=(const Arena &ref) = delete;
+    Arena(Arena &&src) = delete;
+    Arena &operator=(Arena &&src) = delete;
+
+private:
+    std::size_t m_block_size;
+    std::vector<std::unique_ptr<char[]> > m_blocks;
+    char *m_head;
+    char *m_end;
+    std::size_t m_bytes_used;
+    std::size_t m_bytes_reserved;
+
+public:
+    /**
+     * Allocate @a size bytes aligned to @a alignment, which must be a power
+     * of two not larger than alignof(std::max_align_t).
+     */
+    void *allocate(std::size_t size,
+                   std::size_t alignment = alignof(std::max_align_t));
+
+    template <typename T, typename... Args>
+    T *create(Args&&... args)
+    {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Copy @a text into the arena.
+     */
+    std::string_view intern(std::string_view text);
+
+    inline std::size_t block_size() const
+    {
+        return m_block_size;
+    }
+
+    /**
+     * Number of bytes handed out so far, including alignment padding.
+     */
+    inline std::size_t bytes_used() const
+    {
+        return m_bytes_used;
+    }
+
+    /**
+     * Number of bytes allocated from the system for the arena's blocks.
+     */
+    inline std::size_t bytes_reserved() const
+    {
+        return m_bytes_reserved;
+    }
+
+};
+
+}
+
+#endif
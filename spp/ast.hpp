@@ -1,11 +1,20 @@
 #ifndef SPP_AST_H
 #define SPP_AST_H
 
+#include <cstdint>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
 #include <vector>
 
 #include "location.hh"
 
+#include "spp/arena.hpp"
+#include "spp/buffer.hpp"
+
 namespace spp {
 
 
@@ -23,128 +32,141 @@ enum class ProgramType {
 
 
 class EvaluationContext;
+class EvaluationPlan;
+class Fragments;
+class Program;
 
 
-template <typename internal_iterator, typename for_class>
-class DereferencingIterator
-{
-public:
-    typedef std::bidirectional_iterator_tag iterator_category;
-    typedef typename internal_iterator::difference_type difference_type;
-    typedef typename internal_iterator::value_type::element_type &value_type;
-    typedef value_type reference;
-    typedef typename internal_iterator::value_type::element_type *&pointer;
+/**
+ * The kinds of sections a program can consist of.
+ */
+enum class SectionKind: std::uint8_t {
+    /**
+     * The version declaration; version(), profile() and type() are valid.
+     */
+    VERSION = 0,
+
+    /**
+     * Verbatim shader source; source() is valid.
+     */
+    STATIC_SOURCE = 1,
+
+    /**
+     * An include directive; path() is valid.
+     */
+    INCLUDE = 2,
+
+    /**
+     * A resolved include which was not expanded; program() is the included
+     * program and path() its path. It evaluates to the included program
+     * without its version declaration.
+     */
+    INCLUDED_PROGRAM = 3,
+
+    /**
+     * An include_once directive; path() is valid. Like an include, but the
+     * file is expanded at most once per evaluated program.
+     */
+    INCLUDE_ONCE = 4,
+
+    /**
+     * Marks the start of a file included with include_once; path() is the
+     * canonical path of the file and guarded() the number of sections which
+     * follow and belong to it. Evaluates to nothing, but the guarded
+     * sections are skipped if the file was already expanded before.
+     */
+    INCLUDE_GUARD = 5
+};
 
-public:
-    DereferencingIterator(internal_iterator curr):
-        m_curr(curr)
-    {
 
-    }
+/**
+ * Section of a shader program.
+ *
+ * Sections are small values tagged with their kind; they are stored by value
+ * in their Program. A section does not own its text: static source refers to
+ * a SourceBuffer retained by the Program and paths and profiles are owned by
+ * the Program (see Program::intern()).
+ */
+class Section
+{
+public:
+    static Section version_declaration(const location &location,
+                                       unsigned int version,
+                                       std::string_view profile,
+                                       ProgramType type);
+    static Section static_source(const location &location,
+                                 std::string_view source);
+    static Section include_directive(const location &location,
+                                     std::string_view path);
+    static Section included_program(const location &location,
+                                    std::string_view path,
+                                    const Program *program);
+    static Section include_once_directive(const location &location,
+                                          std::string_view path);
+    static Section include_guard(const location &location,
+                                 std::string_view path,
+                                 unsigned int guarded);
 
 private:
-    internal_iterator m_curr;
+    Section(SectionKind kind,
+            const location &location,
+            std::string_view text,
+            unsigned int version = 0,
+            ProgramType type = ProgramType::GENERIC,
+            const Program *program = nullptr);
 
-public:
-    inline bool operator==(const DereferencingIterator &other) const
-    {
-        return (m_curr == other.m_curr);
-    }
-
-    inline bool operator!=(const DereferencingIterator &other) const
-    {
-        return (m_curr != other.m_curr);
-    }
+private:
+    location m_location;
+    std::string_view m_text;
+    const Program *m_program;
+    unsigned int m_version;
+    SectionKind m_kind;
+    ProgramType m_type;
 
-    inline DereferencingIterator operator++(int) const
-    {
-        return DereferencingIterator(std::next(m_curr));
-    }
+    friend class Program;
 
-    inline DereferencingIterator &operator++()
+public:
+    inline SectionKind kind() const
     {
-        ++m_curr;
-        return *this;
+        return m_kind;
     }
 
-    inline DereferencingIterator operator--(int) const
+    inline const location &loc() const
     {
-        return DereferencingIterator(std::prev(m_curr));
+        return m_location;
     }
 
-    inline DereferencingIterator &operator--()
+    /**
+     * The text of the section, whichever kind it is.
+     */
+    inline std::string_view text() const
     {
-        --m_curr;
-        return *this;
+        return m_text;
     }
 
-    inline value_type operator*() const
+    inline std::string_view source() const
     {
-        return **m_curr;
+        return m_text;
     }
 
-    inline value_type operator->() const
+    inline std::string_view path() const
     {
-        return **m_curr;
+        return m_text;
     }
 
-    friend for_class;
-};
-
-/**
- * Section of a shader program. A section can be of different types, see the
- * subclasses.
- *
- * @see StaticSourceSection
- */
-class Section
-{
-public:
-    explicit Section(const location &location);
-    Section(const Section &ref) = delete;
-    Section &operator=(const Section &ref) = delete;
-    Section(Section &&src) = delete;
-    Section &operator=(Section &&src) = delete;
-    virtual ~Section();
-
-protected:
-    location m_location;
-
-public:
-    virtual std::unique_ptr<Section> copy() const = 0;
-    virtual void evaluate(std::ostream &into, EvaluationContext &ctx) = 0;
-
-public:
-    inline const location &loc() const
+    inline std::string_view profile() const
     {
-        return m_location;
+        return m_text;
     }
 
-};
-
-
-class VersionDeclaration: public Section
-{
-public:
-    VersionDeclaration(const location &location,
-                       unsigned int version,
-                       const std::string &profile,
-                       ProgramType type);
-
-private:
-    unsigned int m_version;
-    std::string m_profile;
-    ProgramType m_type;
-
-public:
     inline unsigned int version() const
     {
         return m_version;
     }
 
-    inline const std::string &profile() const
+    inline unsigned int guarded() const
     {
-        return m_profile;
+        return m_version;
     }
 
     inline ProgramType type() const
@@ -152,90 +174,109 @@ public:
         return m_type;
     }
 
-public:
-    std::unique_ptr<Section> copy() const override;
-    void evaluate(std::ostream &into, EvaluationContext &ctx) override;
-
-};
-
-
-class StaticSourceSection: public Section
-{
-public:
-    StaticSourceSection() = default;
-    explicit StaticSourceSection(const location &location,
-                                 const std::string &source);
-
-private:
-    std::string m_source;
-
-public:
-    std::unique_ptr<Section> copy() const override;
-    void evaluate(std::ostream &into, EvaluationContext &ctx) override;
-
-    inline std::string &source()
+    inline const Program *program() const
     {
-        return m_source;
+        return m_program;
     }
 
-    inline const std::string &source() const
-    {
-        return m_source;
-    }
+    /**
+     * Grow static source by @a length bytes directly following its current
+     * text, ending at the end of @a until.
+     */
+    void extend(const location &until, std::size_t length);
 
 };
 
 
-class IncludeDirective: public Section
+/**
+ * Receives the parts of a shader program in source order, as the parser
+ * recognises them.
+ *
+ * @see ParserContext::parse(SectionSink&)
+ */
+class SectionSink
 {
 public:
-    explicit IncludeDirective(const location &location, const std::string &path);
-
-private:
-    std::string m_path;
+    virtual ~SectionSink();
 
 public:
-    std::unique_ptr<Section> copy() const override;
-    void evaluate(std::ostream &into, EvaluationContext &ctx) override;
+    virtual void version(const location &location,
+                         unsigned int version,
+                         const std::string &profile,
+                         ProgramType type) = 0;
 
-    inline std::string &path()
-    {
-        return m_path;
-    }
+    /**
+     * Static source text. @a text is only guaranteed to be valid for the
+     * duration of the call.
+     */
+    virtual void source(const location &location, std::string_view text) = 0;
 
-    inline const std::string &path() const
-    {
-        return m_path;
-    }
+    virtual void include(const location &location, const std::string &path) = 0;
+
+    /**
+     * An include_once directive. Defaults to treating it as include().
+     */
+    virtual void include_once(const location &location, const std::string &path);
+
+    virtual void error(const location &location, const std::string &msg) = 0;
 
 };
 
 
+/**
+ * A parsed shader program.
+ *
+ * The sections are stored by value in one contiguous array. A program may
+ * own an Arena, in which case the text it owns is allocated from the arena
+ * instead of individually from the heap and released all at once.
+ *
+ * The text is immutable once parsed and reference counted: programs built
+ * from the sections of other programs (by include resolution or copy())
+ * share their storage instead of copying the text.
+ *
+ * With lazy includes (see Library::set_lazy_includes()), a program refers to
+ * the programs it includes instead of containing their sections; it then
+ * retains those programs and evaluate() walks into them.
+ */
 class Program
 {
 protected:
-    typedef std::vector<std::unique_ptr<Section> > container_type;
+    typedef std::vector<Section> container_type;
 
 public:
-    typedef DereferencingIterator<typename container_type::iterator, Program> iterator;
+    typedef typename container_type::iterator iterator;
     typedef std::reverse_iterator<iterator> reverse_iterator;
-    typedef DereferencingIterator<typename container_type::const_iterator, Program> const_iterator;
+    typedef typename container_type::const_iterator const_iterator;
     typedef typename container_type::size_type size_type;
 
     typedef std::tuple<std::string, location, std::string> RecordedError;
 
 public:
-    explicit Program(const std::string &source_path = "<memory>");
+    explicit Program(const std::string &source_path = "<memory>",
+                     std::shared_ptr<Arena> arena = nullptr);
     Program(const Program &src) = delete;
     Program(Program &&src) = delete;
     Program &operator=(const Program &src) = delete;
     Program &operator=(Program &&src) = delete;
+    ~Program();
 
 private:
     ProgramType m_type;
     std::string m_source_path;
     std::vector<RecordedError> m_errors;
-    std::vector<std::unique_ptr<Section> > m_sections;
+    // the storage must outlive the sections
+    std::shared_ptr<Arena> m_arena;
+    std::shared_ptr<std::deque<std::string> > m_strings;
+    std::size_t m_owned_bytes;
+    std::vector<std::shared_ptr<const void> > m_retained;
+    std::unordered_set<const void*> m_retained_index;
+    container_type m_sections;
+
+    mutable std::mutex m_plan_mutex;
+    mutable std::unique_ptr<EvaluationPlan> m_plan;
+
+private:
+    void invalidate_plan();
 
 public: // interface for the parser
     void add_local_error(const location &location,
@@ -247,7 +288,57 @@ public: // interface for the parser
         return m_errors;
     }
 
-    void append_section(std::unique_ptr<Section> &&sec);
+    /**
+     * Append @a sec. Text referenced by the section must be owned or retained
+     * by the program, see intern(), retain() and share_storage().
+     */
+    void append_section(const Section &sec);
+
+    /**
+     * Copy @a text into storage owned by this program.
+     */
+    std::string_view intern(std::string_view text);
+
+    inline const Arena *arena() const
+    {
+        return m_arena.get();
+    }
+
+    /**
+     * Append a static source section referring to @a source. The text must live
+     * in a buffer retained by this program.
+     *
+     * If the last section is static source ending right where @a source
+     * starts, it is extended instead of appending a new section.
+     */
+    void append_source(const location &location, std::string_view source);
+
+    /**
+     * Keep @a storage (e.g. a SourceBuffer) alive for as long as this program
+     * exists. Sections may only refer to text in retained storage or text
+     * owned by the program.
+     */
+    void retain(const std::shared_ptr<const void> &storage);
+
+    /**
+     * Retain @a buffer as text belonging to this program, such as the buffer
+     * it was parsed from, so that memory_usage() accounts for it.
+     */
+    void own_buffer(const std::shared_ptr<const SourceBuffer> &buffer);
+
+    /**
+     * Retain all storage which the sections of @a other may refer to, so that
+     * they can be used in this program without copying their text.
+     */
+    void share_storage(const Program &other);
+
+    /**
+     * Storage retained by the program, not including the text it owns.
+     */
+    inline const std::vector<std::shared_ptr<const void> > &retained() const
+    {
+        return m_retained;
+    }
 
     inline ProgramType type() const
     {
@@ -263,9 +354,15 @@ public: // interface for the parser
 
 
 public: // container interface
-    inline iterator begin()
+    /*
+     * The sections are read-only through the container interface; they are
+     * changed through insert(), erase() and assign(), which drop the
+     * compiled plan.
+     */
+
+    inline const_iterator begin() const
     {
-        return iterator(m_sections.begin());
+        return const_iterator(m_sections.cbegin());
     }
 
     inline const_iterator cbegin() const
@@ -273,9 +370,9 @@ public: // container interface
         return const_iterator(m_sections.cbegin());
     }
 
-    inline iterator end()
+    inline const_iterator end() const
     {
-        return iterator(m_sections.end());
+        return const_iterator(m_sections.cend());
     }
 
     inline const_iterator cend() const
@@ -288,25 +385,55 @@ public: // container interface
         return m_sections.size();
     }
 
-    inline Section &operator[](const size_type pos)
-    {
-        return *m_sections[pos];
-    }
-
     inline const Section &operator[](const size_type pos) const
     {
-        return *m_sections[pos];
+        return m_sections[pos];
     }
 
-    iterator erase(iterator iter);
-    iterator erase(iterator first, iterator last);
-    iterator insert(iterator before, std::unique_ptr<Section> &&section);
+    const_iterator erase(const_iterator iter);
+    const_iterator erase(const_iterator first, const_iterator last);
+    const_iterator insert(const_iterator before, const Section &section);
+
+    /**
+     * Replace all sections of the program with @a sections.
+     */
+    void assign(std::vector<Section> &&sections);
 
 
 public:
     std::unique_ptr<Program> copy() const;
 
+    /**
+     * Approximate number of bytes held by the program: the sections, the
+     * buffers passed to own_buffer(), the strings it interned and the used
+     * part of its arena. Storage retained from other programs (included
+     * text and lazily included programs) is not counted, so that text shared
+     * between programs is only charged to the program it belongs to.
+     */
+    std::size_t memory_usage() const;
+
+    /**
+     * The evaluation plan of the program. It is compiled on first use and
+     * kept until the program is modified.
+     *
+     * It is safe to call this concurrently, but not concurrently with
+     * modifying the program.
+     */
+    const EvaluationPlan &plan() const;
+
     void evaluate(std::ostream &into, EvaluationContext &ctx) const;
+
+    /**
+     * Fingerprint of the output of evaluate() with @a ctx, see
+     * EvaluationPlan::fingerprint().
+     */
+    std::uint64_t fingerprint(const EvaluationContext &ctx) const;
+
+    /**
+     * Evaluate the program into a list of fragments referring to its text,
+     * see Fragments.
+     */
+    Fragments evaluate(EvaluationContext &ctx) const;
 };
 
 }
@@ -0,0 +1,79 @@
+#ifndef SPP_BUFFER_H
+#define SPP_BUFFER_H
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+
+namespace spp {
+
+/**
+ * Contiguous, read-only shader source.
+ *
+ * Sections of a Program parsed from a buffer refer to the text in the buffer
+ * instead of copying it, which is why buffers are always handled through
+ * shared pointers: each Program keeps the buffers its sections point into
+ * alive.
+ */
+class SourceBuffer
+{
+public:
+    /**
+     * Create a buffer which owns its data.
+     */
+    explicit SourceBuffer(std::string &&data);
+
+    /**
+     * Create a buffer which refers to memory owned by the caller. The memory
+     * must stay valid and unchanged for as long as the buffer exists.
+     */
+    SourceBuffer(const char *data, std::size_t size);
+
+    SourceBuffer(const SourceBuffer &ref) = delete;
+    SourceBuffer &operator=(const SourceBuffer &ref) = delete;
+    SourceBuffer(SourceBuffer &&src) = delete;
+    SourceBuffer &operator=(SourceBuffer &&src) = delete;
+
+private:
+    std::string m_storage;
+    const char *m_data;
+    std::size_t m_size;
+
+public:
+    inline const char *data() const
+    {
+        return m_data;
+    }
+
+    inline std::size_t size() const
+    {
+        return m_size;
+    }
+
+    inline std::string_view view() const
+    {
+        return std::string_view(m_data, m_size);
+    }
+
+public:
+    /**
+     * Read the remainder of @a in into a new, owning buffer.
+     */
+    static std::shared_ptr<const SourceBuffer> from_stream(std::istream &in);
+
+    /**
+     * Map the file at @a path into memory, if the platform supports it, or
+     * read it into an owning buffer otherwise. The file must not be modified
+     * while the buffer exists.
+     *
+     * @return nullptr if the file cannot be opened.
+     */
+    static std::shared_ptr<const SourceBuffer> map_file(const std::string &path);
+
+};
+
+}
+
+#endif
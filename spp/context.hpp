@@ -1,13 +1,26 @@
 #ifndef SPP_CONTEXT_H
 #define SPP_CONTEXT_H
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <mutex>
+#include <optional>
 #include <unordered_map>
-#include <set>
+#include <unordered_set>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "spp/lexer.hpp"
 #include "spp/ast.hpp"
+#include "spp/buffer.hpp"
+#include "spp/hash.hpp"
 #include "spp/loader.hpp"
+#include "spp/threadpool.hpp"
 
 /**
  * This namespace holds the Shader Preprocessor interface and implementation.
@@ -15,60 +28,353 @@
 namespace spp {
 
 class location;
+class EvaluationContext;
 
 /**
  * Context for a Shader Preprocessor parser.
+ *
+ * To build a Program, the parser works on a contiguous SourceBuffer and the
+ * resulting Program refers to the text in that buffer instead of copying it.
+ * When constructed from a stream, the stream is read into a buffer owned by
+ * the Program on parse().
  */
 class ParserContext
 {
 public:
     ParserContext(std::istream &in, const std::string &source_path = "<memory>");
+    explicit ParserContext(std::shared_ptr<const SourceBuffer> buffer,
+                           const std::string &source_path = "<memory>");
     virtual ~ParserContext();
 
 private:
-    std::istream &m_in;
+    std::istream *m_in;
+    std::shared_ptr<const SourceBuffer> m_buffer;
     std::string m_source_path;
 
-    Scanner m_scanner;
+    ScannerType m_scanner_type;
+    std::size_t m_arena_block_size;
+    std::unique_ptr<Scanner> m_scanner;
 
 protected:
     std::vector<std::tuple<location, std::string> > m_errors;
 
+private:
+    void create_scanner();
+
 public:
+    /**
+     * Select the scanner implementation to use. Both produce the same
+     * Program; the default is ScannerType::FLEX.
+     */
+    inline void set_scanner_type(ScannerType type)
+    {
+        m_scanner_type = type;
+    }
+
+    /**
+     * Allocate the strings interned by parsed programs (version profiles and
+     * include paths) from an Arena with the given block size. Zero (the
+     * default) disables the arena.
+     */
+    inline void set_arena_block_size(std::size_t block_size)
+    {
+        m_arena_block_size = block_size;
+    }
+
+    /**
+     * The scanner used by the parser. Only valid while parsing.
+     */
     inline Scanner &lexer()
     {
-        return m_scanner;
+        return *m_scanner;
     }
 
     inline const Scanner &lexer() const
     {
-        return m_scanner;
+        return *m_scanner;
     }
 
     std::unique_ptr<Program> parse();
 
+    /**
+     * Parse the input without building a Program, passing the sections to
+     * @a sink as they are recognised.
+     *
+     * When the context was constructed from a stream, the stream is scanned
+     * incrementally, so memory use is bounded by the scanner's buffer and
+     * not by the size of the input.
+     *
+     * @return true if the input could be parsed; syntax errors which the
+     * parser recovered from are reported to the sink and do not count as
+     * failure.
+     */
+    bool parse(SectionSink &sink);
+
 };
 
 
+/**
+ * Loads programs through a Loader, resolves their includes and caches them by
+ * canonical path (see Loader::canonical()). Files with identical contents
+ * share their text and are only parsed once.
+ *
+ * Loading and evaluation are thread-safe: concurrent loads of the same path
+ * wait for a single load instead of parsing the file twice. The setters are
+ * not thread-safe and should be called before the library is shared.
+ */
 class Library
 {
 public:
+    /**
+     * Create a library which loads files from the file system through a
+     * DefaultLoader.
+     */
     Library();
     explicit Library(std::unique_ptr<Loader> &&loader);
     virtual ~Library();
 
+protected:
+    /**
+     * The chain of files being loaded by one thread, from the requested file
+     * down to the file currently being loaded. Used to detect recursive
+     * includes and to limit the include depth.
+     */
+    struct LoadChain
+    {
+        std::vector<std::string> stack;
+    };
+
+    /**
+     * A load which has been started or scheduled. Scheduled loads are
+     * claimed by whichever thread gets to them first: a pool worker or a
+     * thread which needs the program.
+     */
+    struct PendingLoad
+    {
+        std::promise<std::shared_ptr<Program> > promise;
+        // the include stack the load was scheduled from
+        std::vector<std::string> stack;
+        // the path to open the file by, as it was requested
+        std::string open_path;
+        // guarded by m_wait_mutex
+        bool claimed;
+    };
+
+    struct CacheEntry
+    {
+        std::shared_future<std::shared_ptr<Program> > program;
+        std::shared_ptr<PendingLoad> pending;
+        // accounted once the load finished
+        std::size_t bytes;
+        std::uint64_t last_use;
+    };
+
+    struct CacheShard
+    {
+        std::mutex mutex;
+        std::unordered_map<std::string, CacheEntry> entries;
+    };
+
+    static constexpr std::size_t cache_shard_count = 16;
+
 protected:
     unsigned int m_max_include_depth;
+    ScannerType m_scanner_type;
+    std::size_t m_arena_block_size;
+    bool m_lazy_includes;
     std::unique_ptr<Loader> m_loader;
-    std::unordered_map<std::string, std::unique_ptr<Program> > m_cache;
+    std::string m_disk_cache;
+    std::array<CacheShard, cache_shard_count> m_cache;
+
+    std::atomic<std::size_t> m_program_budget;
+    std::atomic<std::size_t> m_program_bytes;
+    std::atomic<std::uint64_t> m_program_clock;
+    std::atomic<std::uint64_t> m_program_hits;
+    std::atomic<std::uint64_t> m_program_misses;
+    std::atomic<std::uint64_t> m_program_evictions;
+    std::atomic<std::uint64_t> m_program_scans;
+    // after a scan which could not get below the budget, the cache size
+    // from which on to scan again
+    std::atomic<std::size_t> m_program_rescan_bytes;
+    // only one thread evicts at a time
+    std::mutex m_program_eviction_mutex;
+
+    // which chain loads which path and which path each chain waits for;
+    // waiting must not close a cycle, as that would deadlock
+    std::mutex m_wait_mutex;
+    std::unordered_map<std::string, const LoadChain*> m_loading;
+    std::unordered_map<const LoadChain*, std::string> m_waiting;
+
+    // include graph in both directions and the files loaded directly,
+    // used by invalidate()
+    std::mutex m_graph_mutex;
+    std::unordered_map<std::string, std::unordered_set<std::string> > m_includes;
+    std::unordered_map<std::string, std::unordered_set<std::string> > m_includers;
+    // canonical path -> path as requested
+    std::unordered_map<std::string, std::string> m_roots;
+    // content hashes of the files as they were parsed or validated
+    std::unordered_map<std::string, std::optional<std::uint64_t> > m_content_hashes;
+
+    struct ContentEntry
+    {
+        std::string path;
+        std::weak_ptr<const SourceBuffer> buffer;
+        std::weak_ptr<const Program> program;
+    };
+    // error-free programs by the content hash of their file, so that copies
+    // of a file under different paths share the parsed program
+    std::unordered_map<std::uint64_t, ContentEntry> m_programs_by_content;
+
+    std::shared_ptr<ThreadPool> m_pool;
+    // scheduled loads which have not finished yet
+    std::mutex m_prefetch_mutex;
+    std::condition_variable m_prefetch_done;
+    std::size_t m_prefetching;
+
+    struct EvaluationKey
+    {
+        std::uint64_t program_hash;
+        std::uint64_t defines_hash;
+
+        inline bool operator==(const EvaluationKey &other) const
+        {
+            return program_hash == other.program_hash &&
+                    defines_hash == other.defines_hash;
+        }
+    };
+
+    struct EvaluationKeyHash
+    {
+        inline std::size_t operator()(const EvaluationKey &key) const
+        {
+            return key.program_hash ^ (key.defines_hash * 0x9E3779B97F4A7C15ULL);
+        }
+    };
+
+    typedef std::list<std::pair<EvaluationKey, std::shared_ptr<const std::string> > > EvaluationLRU;
+
+    mutable std::mutex m_evaluation_mutex;
+    std::size_t m_evaluation_budget;
+    std::size_t m_evaluation_bytes;
+    // most recently used first
+    EvaluationLRU m_evaluation_lru;
+    std::unordered_map<EvaluationKey, EvaluationLRU::iterator, EvaluationKeyHash> m_evaluation_cache;
 
 protected:
-    void resolve_includes(Program *in_program, unsigned int depth);
-    virtual const Program *_load(const std::string &path, unsigned int depth);
+    CacheShard &cache_shard(const std::string &path);
+    bool claim_load(const std::string &path,
+                    const LoadChain &chain,
+                    PendingLoad &pending);
+    void wait_for_load(const LoadChain &chain,
+                       const std::string &path,
+                       const CacheEntry &entry);
+    void prefetch(const std::string &path,
+                  const std::string &open_path,
+                  const std::vector<std::string> &stack);
+    std::vector<std::string> canonical_includes(const Program &program);
+    void prefetch_includes(const Program &program,
+                           const std::vector<std::string> &include_paths,
+                           const LoadChain &chain);
+    void record_include(const std::string &includer, const std::string &included);
+    std::optional<std::uint64_t> content_hash(const std::string &path);
+    std::shared_ptr<Program> find_duplicate(const std::string &path,
+                                            const std::string &open_path,
+                                            const SourceBuffer &buffer,
+                                            std::uint64_t hash);
+    std::uint64_t settings_hash() const;
+    std::string disk_cache_path(const std::string &path) const;
+    std::shared_ptr<Program> load_from_disk_cache(const std::string &path,
+                                                  LoadChain &chain);
+    void write_to_disk_cache(const std::string &path, const Program &program);
+    void resolve_includes(Program *in_program,
+                          const std::vector<std::string> &include_paths,
+                          LoadChain &chain);
+    void evict_evaluations();
+    static bool is_unreferenced(const CacheEntry &entry);
+    void evict_programs();
+    std::shared_ptr<Program> parse_and_resolve(const std::string &path,
+                                               const std::string &open_path,
+                                               LoadChain &chain);
+    std::shared_ptr<Program> run_load(const std::string &path,
+                                      LoadChain &chain,
+                                      PendingLoad &pending);
+    virtual std::shared_ptr<const Program> _load(const std::string &path,
+                                                 LoadChain &chain);
+    // like above, with the canonical path already known
+    std::shared_ptr<const Program> _load(const std::string &path,
+                                         const std::string &open_path,
+                                         LoadChain &chain);
 
 public:
+    /**
+     * Load the program at @a path, or return the cached program. The pointer
+     * stays valid until the file is invalidated, see invalidate().
+     */
     const Program *load(const std::string &path);
 
+    /**
+     * Like load(), but the returned program stays valid for as long as it is
+     * referenced, even if the file is invalidated.
+     */
+    std::shared_ptr<const Program> acquire(const std::string &path);
+
+    /**
+     * A file which failed to load during preload(), with the errors of its
+     * program or the reason it could not be loaded.
+     */
+    struct PreloadFailure
+    {
+        std::string path;
+        std::vector<Program::RecordedError> errors;
+    };
+
+    /**
+     * Load all of @a paths, like acquire(), on @a threads threads (zero uses
+     * one per hardware thread), and return once all of them are cached.
+     * Includes shared between the files are only loaded once.
+     *
+     * @return The files which failed to load or have errors, in the order
+     * of @a paths.
+     */
+    std::vector<PreloadFailure> preload(const std::vector<std::string> &paths,
+                                        unsigned int threads = 0);
+
+    /**
+     * Like preload(), with the paths read from the manifest at
+     * @a manifest_path, which is opened through the Loader. The manifest
+     * lists one path per line; empty lines and lines starting with '#' are
+     * ignored.
+     *
+     * @throws std::runtime_error if the manifest cannot be opened.
+     */
+    std::vector<PreloadFailure> preload_manifest(const std::string &manifest_path,
+                                                 unsigned int threads = 0);
+
+    /**
+     * Drop the cached program at @a path and every cached program which
+     * includes it, directly or transitively, and reload the affected files
+     * which were loaded through load() or acquire().
+     *
+     * Pointers returned by load() for the dropped programs become invalid.
+     * Changes to files which are being loaded while this runs may be missed.
+     *
+     * @return The reloaded programs, ordered by path; nullptr for files which
+     * can no longer be opened.
+     */
+    std::vector<std::shared_ptr<const Program> > invalidate(const std::string &path);
+
+    /**
+     * Evaluate @a program with @a ctx.
+     *
+     * If an evaluation cache budget is set, the output is memoized, keyed by
+     * the content hash of the program and the hash of the define block of
+     * the context, so that repeated evaluations only cost a lookup.
+     *
+     * @see set_evaluation_cache_budget()
+     */
+    std::shared_ptr<const std::string> evaluate(const Program &program,
+                                                const EvaluationContext &ctx);
+
 public:
     inline void set_loader(std::unique_ptr<Loader> &&loader)
     {
@@ -80,9 +386,126 @@ public:
         m_max_include_depth = depth;
     }
 
+    inline void set_scanner_type(ScannerType type)
+    {
+        m_scanner_type = type;
+    }
+
+    /**
+     * Parse included files in parallel on @a pool: as soon as a file is
+     * parsed, the files it includes which are not cached yet are scheduled
+     * on the pool. Includes are still resolved in order, so errors and the
+     * resulting programs are the same as without a pool.
+     *
+     * Without a pool (the default), files are loaded one after another.
+     */
+    inline void set_thread_pool(std::shared_ptr<ThreadPool> pool)
+    {
+        m_pool = std::move(pool);
+    }
+
+    /**
+     * Give each parsed program an Arena with the given block size, from
+     * which the strings it interns are allocated. Programs which intern
+     * nothing (deduplicated or read from the disk cache) share the storage
+     * of others instead. Zero (the default) disables the arenas.
+     */
+    inline void set_arena_block_size(std::size_t block_size)
+    {
+        m_arena_block_size = block_size;
+    }
+
+    /**
+     * Keep included programs as references instead of splicing their
+     * sections into the including program. Load time and cache memory then
+     * scale with the unique source instead of the expanded source; the
+     * evaluated output is the same.
+     *
+     * Only affects programs loaded after the call.
+     */
+    inline void set_lazy_includes(bool lazy)
+    {
+        m_lazy_includes = lazy;
+    }
+
+    /**
+     * Keep resolved programs in binary files in @a directory, which must
+     * exist, so that later processes do not need to parse them again. An
+     * empty path (the default) disables the disk cache.
+     *
+     * Cached programs are memory-mapped and only used if all files they
+     * were built from still have the same content hash (see
+     * Loader::content_hash()); otherwise the file is parsed and the cached
+     * program replaced.
+     */
+    inline void set_disk_cache(const std::string &directory)
+    {
+        m_disk_cache = directory;
+    }
+
+    /**
+     * Limit the programs cached by path to about @a bytes (see
+     * Program::memory_usage()), evicting the least recently loaded programs
+     * first. Zero (the default) disables eviction.
+     *
+     * Each program is charged for its own text, not for the text of the
+     * files it includes. Evicting an included program does not release its
+     * text while cached includers still refer to it.
+     *
+     * Only programs which are referenced by nothing but the cache are
+     * evicted, i.e. those not held through acquire() or included lazily by
+     * another cached program. With a budget, pointers returned by load()
+     * may become invalid on any later load; use acquire() instead.
+     *
+     * Finding evictable programs takes a scan of the whole cache. If a scan
+     * cannot get the cache below the budget, the next one only happens once
+     * the cache has grown by another eighth, so programs released in the
+     * meantime may stay cached for a while.
+     */
+    void set_program_cache_budget(std::size_t bytes);
+
+    /**
+     * Counters of the program cache, to tune its budget.
+     */
+    struct ProgramCacheStats
+    {
+        std::uint64_t hits;
+        std::uint64_t misses;
+        std::uint64_t evictions;
+        std::size_t bytes;
+        // scans of the cache for evictable programs
+        std::uint64_t scans;
+    };
+
+    ProgramCacheStats program_cache_stats() const;
+
+    /**
+     * Limit the memoized evaluation output to @a bytes, evicting the least
+     * recently used outputs first. Zero (the default) disables memoization.
+     */
+    void set_evaluation_cache_budget(std::size_t bytes);
+
+    inline std::size_t evaluation_cache_bytes() const
+    {
+        std::lock_guard<std::mutex> lock(m_evaluation_mutex);
+        return m_evaluation_bytes;
+    }
+
+    inline std::size_t evaluation_cache_size() const
+    {
+        std::lock_guard<std::mutex> lock(m_evaluation_mutex);
+        return m_evaluation_cache.size();
+    }
+
 };
 
 
+/**
+ * The defines to inject into evaluated programs.
+ *
+ * The define block ("#define NAME VALUE" lines) is rendered as the defines
+ * are added and reused for every program evaluated with the context.
+ */
 class EvaluationContext
 {
 public:
@@ -94,16 +517,94 @@ public:
 
 private:
     Library &m_library;
-    std::set<std::string> m_define_names;
+    std::string m_define_block;
     std::vector<Define> m_defines;
+    // hash of the name -> index in m_defines; the names themselves move when
+    // m_defines grows, so they are not referred to
+    std::unordered_multimap<std::size_t, std::size_t> m_define_index;
+    XXH64Stream m_define_block_hash;
+
+private:
+    template <typename T>
+    void define_vector(std::string_view name,
+                       std::string_view type,
+                       const T *values,
+                       std::size_t count);
 
 public:
-    void define(const std::string &name, const std::string &rhs);
-    void define1ull(const std::string &name, const unsigned long long value);
-    void define1ll(const std::string &name, const signed long long value);
-    void define1f(const std::string &name, const float value);
-    void define1d(const std::string &name, const double value);
+    /**
+     * Define @a name as @a rhs.
+     *
+     * @throws std::invalid_argument if @a name is already defined.
+     */
+    void define(std::string_view name, std::string_view rhs);
+    void define1ull(std::string_view name, const unsigned long long value);
+    void define1ll(std::string_view name, const signed long long value);
+    void define1f(std::string_view name, const float value);
+    void define1d(std::string_view name, const double value);
+
+    /*
+     * Vector defines, rendered as GLSL constructors such as
+     * "vec3(1.0, 0.5, 2.0)".
+     *
+     * Floating point values are written in their shortest form which reads
+     * back as the same value, independent of the locale. Doubles carry the
+     * "lf" suffix and unsigned integers the "u" suffix, so that GLSL reads
+     * them with their own type.
+     */
+
+    void define2f(std::string_view name, const float x, const float y);
+    void define3f(std::string_view name, const float x, const float y,
+                  const float z);
+    void define4f(std::string_view name, const float x, const float y,
+                  const float z, const float w);
+
+    void define2d(std::string_view name, const double x, const double y);
+    void define3d(std::string_view name, const double x, const double y,
+                  const double z);
+    void define4d(std::string_view name, const double x, const double y,
+                  const double z, const double w);
+
+    void define2i(std::string_view name, const std::int32_t x,
+                  const std::int32_t y);
+    void define3i(std::string_view name, const std::int32_t x,
+                  const std::int32_t y, const std::int32_t z);
+    void define4i(std::string_view name, const std::int32_t x,
+                  const std::int32_t y, const std::int32_t z,
+                  const std::int32_t w);
+
+    void define2ui(std::string_view name, const std::uint32_t x,
+                   const std::uint32_t y);
+    void define3ui(std::string_view name, const std::uint32_t x,
+                   const std::uint32_t y, const std::uint32_t z);
+    void define4ui(std::string_view name, const std::uint32_t x,
+                   const std::uint32_t y, const std::uint32_t z,
+                   const std::uint32_t w);
 
+    /**
+     * The rendered define block, valid until the next define.
+     */
+    inline std::string_view define_block() const
+    {
+        return m_define_block;
+    }
+
+    inline std::size_t define_count() const
+    {
+        return m_defines.size();
+    }
+
+    /**
+     * XXH64 of the define block, kept up to date as defines are added.
+     */
+    inline std::uint64_t define_block_hash() const
+    {
+        return m_define_block_hash.digest();
+    }
+
+    /**
+     * The defines in order of definition.
+     */
     inline const std::vector<Define> &defines() const
     {
         return m_defines;
@@ -111,7 +612,6 @@ public:
 
 };
 
-
 }
 
 #endif
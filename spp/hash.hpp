@@ -0,0 +1,53 @@
+#ifndef SPP_HASH_H
+#define SPP_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+
+namespace spp {
+
+/**
+ * Streaming XXH64 hash.
+ *
+ * Feeding the same bytes in any split over update() calls produces the same
+ * digest as xxh64() over all of them.
+ */
+class XXH64Stream
+{
+public:
+    explicit XXH64Stream(std::uint64_t seed = 0);
+
+private:
+    std::uint64_t m_acc[4];
+    std::uint64_t m_seed;
+    std::uint64_t m_total_size;
+    unsigned char m_buffer[32];
+    std::size_t m_buffered;
+
+public:
+    void update(const void *data, std::size_t size);
+
+    inline void update(std::string_view data)
+    {
+        update(data.data(), data.size());
+    }
+
+    void update_u64(std::uint64_t value);
+
+    std::uint64_t digest() const;
+
+};
+
+// no default seed, so that xxh64("text", seed) picks the string_view overload
+std::uint64_t xxh64(const void *data, std::size_t size, std::uint64_t seed);
+
+inline std::uint64_t xxh64(std::string_view data, std::uint64_t seed = 0)
+{
+    return xxh64(data.data(), data.size(), seed);
+}
+
+}
+
+#endif
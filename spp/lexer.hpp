@@ -14,10 +14,23 @@
 #undef yyFlexLexer
 #endif
 
+#include <cstddef>
+
 namespace spp {
 
 class ParserContext;
 
+/**
+ * Text of a SOURCECODE token. When scanning a contiguous buffer, this points
+ * into that buffer; otherwise it points into the scanner's own buffer and is
+ * only valid until the next token is requested.
+ */
+struct TokenText
+{
+    const char *data;
+    std::size_t size;
+};
+
 }
 
 #include "spp/ast.hpp"
@@ -25,6 +38,22 @@ class ParserContext;
 
 namespace spp {
 
+/**
+ * Selects the scanner implementation used by a ParserContext.
+ */
+enum class ScannerType {
+    /**
+     * Use the flex rules for all input.
+     */
+    FLEX = 0,
+    /**
+     * Skip over static source with scan_code() and only use the flex rules
+     * for the version declaration and directives (see SimdScanner).
+     */
+    SIMD = 1
+};
+
+
 class Scanner: ::sppFlexLexer
 {
 public:
@@ -32,8 +61,40 @@ public:
             std::istream *arg_yyin,
             std::ostream *arg_yyout);
 
+    /**
+     * Scan @a size bytes at @a data. The memory must stay valid while the
+     * scanner and any token text obtained from it are in use.
+     */
+    Scanner(ParserContext &context,
+            const char *data,
+            std::size_t size);
+
     ~Scanner() override;
 
+protected:
+    const char *m_source;
+    std::size_t m_source_size;
+    std::size_t m_read_pos;
+    std::size_t m_read_limit;
+    std::size_t m_offset;
+
+protected:
+    int LexerInput(char *buf, int max_size) override;
+
+    TokenText token_text() const;
+
+    /**
+     * Return true if the flex rules are in the CODE start condition.
+     */
+    bool in_code() const;
+
+    /**
+     * Discard any input the flex rules have read ahead and continue with the
+     * directive body at @a offset into the source buffer.
+     */
+    void continue_in_directive(std::size_t offset);
+
+public:
     virtual Parser::token_type lex(
             Parser::semantic_type *yylval,
             Parser::location_type *yylloc);
@@ -41,6 +102,33 @@ public:
     void set_debug(bool debug);
 };
 
+
+/**
+ * Scanner which handles the static source in the CODE start condition
+ * itself, using scan_code() to skip to the next directive opener. The flex
+ * rules (and their per-token location bookkeeping) only run for the version
+ * declaration and the directives.
+ *
+ * A whole run of static text is returned as one SOURCECODE token, so the
+ * Program produced by the parser is identical to the one obtained with the
+ * plain Scanner, which returns one token per line.
+ *
+ * Only works on contiguous buffers.
+ */
+class SimdScanner: public Scanner
+{
+public:
+    SimdScanner(ParserContext &context,
+                const char *data,
+                std::size_t size);
+
+public:
+    Parser::token_type lex(
+            Parser::semantic_type *yylval,
+            Parser::location_type *yylloc) override;
+
+};
+
 }
 
 #endif
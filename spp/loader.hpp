@@ -1,10 +1,13 @@
 #ifndef SPP_LOADER_H
 #define SPP_LOADER_H
 
+#include <cstdint>
 #include <istream>
 #include <memory>
+#include <optional>
 #include <string>
 
+#include "spp/buffer.hpp"
 
 namespace spp {
 
@@ -16,6 +19,37 @@ public:
 public:
     virtual std::unique_ptr<std::istream> open(const std::string &path) = 0;
 
+    /**
+     * Open the file at @a path as one contiguous, read-only buffer, which
+     * the parser works on directly. Returns nullptr if the file cannot be
+     * opened.
+     *
+     * The default implementation reads the stream returned by open() into
+     * an owning buffer, so a stream which fails to read yields an empty
+     * buffer; loaders which have the data in memory already, or can map it,
+     * should override this.
+     */
+    virtual std::shared_ptr<const SourceBuffer> open_buffer(const std::string &path);
+
+    /**
+     * XXH64 hash of the contents of the file at @a path, or nothing if the
+     * file cannot be opened. Used to validate cached programs.
+     *
+     * The default implementation reads the file through open().
+     */
+    virtual std::optional<std::uint64_t> content_hash(const std::string &path);
+
+    /**
+     * The identity of the file at @a path: paths which refer to the same
+     * file should have the same canonical path. The Library uses it as the
+     * key of its caches, but still opens files by the path as requested.
+     * The canonical path must be accepted by content_hash(), which is used
+     * to validate the disk cache.
+     *
+     * The default implementation returns @a path unchanged.
+     */
+    virtual std::string canonical(const std::string &path);
+
 };
 
 
@@ -24,6 +58,40 @@ class DefaultLoader: public Loader
 public:
     std::unique_ptr<std::istream> open(const std::string &path) override;
 
+    /**
+     * The absolute path with symbolic links and "." and ".." resolved (see
+     * std::filesystem::weakly_canonical()).
+     */
+    std::string canonical(const std::string &path) override;
+
+};
+
+
+/**
+ * Loads files from the file system by memory-mapping them (see
+ * SourceBuffer::map_file()), so that parsing a file costs one open and one
+ * mapping and its text is never copied.
+ *
+ * Programs refer to the mapped text for as long as they exist, so the files
+ * must not be modified in place meanwhile: rewriting a file (as most editors
+ * and std::ofstream do) changes the text of live programs, and reading past
+ * the new end of a truncated file raises SIGBUS. Use it for files which are
+ * only ever replaced by renaming, or not at all, e.g. shipped assets; use
+ * DefaultLoader when files are edited while the Library runs, e.g. together
+ * with LibraryWatcher.
+ */
+class MmapLoader: public Loader
+{
+public:
+    std::unique_ptr<std::istream> open(const std::string &path) override;
+    std::shared_ptr<const SourceBuffer> open_buffer(const std::string &path) override;
+    std::optional<std::uint64_t> content_hash(const std::string &path) override;
+
+    /**
+     * Like DefaultLoader::canonical().
+     */
+    std::string canonical(const std::string &path) override;
+
 };
 
 }
@@ -0,0 +1,103 @@
+#ifndef SPP_PERMUTATION_H
+#define SPP_PERMUTATION_H
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "spp/context.hpp"
+#include "spp/threadpool.hpp"
+
+
+namespace spp {
+
+/**
+ * The cartesian product of a set of define axes, such as SHADOWS={0,1} and
+ * LIGHTS={1,2,4,8}, minus excluded combinations.
+ */
+class PermutationMatrix
+{
+public:
+    /**
+     * One permutation: the index of the chosen value for each axis, in the
+     * order the axes were added.
+     */
+    typedef std::vector<std::size_t> Choice;
+
+    /**
+     * A rule which returns true for permutations to leave out.
+     */
+    typedef std::function<bool(const PermutationMatrix &matrix, const Choice &choice)> Rule;
+
+    struct Axis
+    {
+        std::string name;
+        std::vector<std::string> values;
+    };
+
+public:
+    PermutationMatrix() = default;
+
+private:
+    std::vector<Axis> m_axes;
+    std::vector<Rule> m_exclusions;
+
+public:
+    /**
+     * Add an axis. Each permutation defines @a name as one of @a values.
+     *
+     * @throws std::invalid_argument if @a values is empty or the axis exists.
+     */
+    void add_axis(std::string name, std::vector<std::string> values);
+
+    void exclude(Rule rule);
+
+    inline const std::vector<Axis> &axes() const
+    {
+        return m_axes;
+    }
+
+    /**
+     * The value chosen for the axis called @a axis in @a choice.
+     *
+     * @throws std::out_of_range if there is no such axis.
+     */
+    std::string_view value(const Choice &choice, std::string_view axis) const;
+
+    /**
+     * All permutations which are not excluded, in a deterministic order: the
+     * last axis varies fastest.
+     */
+    std::vector<Choice> permutations() const;
+
+};
+
+
+/**
+ * An evaluated permutation.
+ */
+struct Variant
+{
+    PermutationMatrix::Choice choice;
+    std::string source;
+};
+
+
+/**
+ * Evaluate @a program for each permutation of @a matrix on @a pool.
+ *
+ * Each variant is evaluated with the defines of @a base followed by the
+ * defines of its permutation. All variants share the program and its
+ * evaluation plan.
+ *
+ * @return the variants, in the order of PermutationMatrix::permutations().
+ */
+std::vector<Variant> evaluate_permutations(const Program &program,
+                                           const EvaluationContext &base,
+                                           const PermutationMatrix &matrix,
+                                           ThreadPool &pool);
+
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef SPP_PLAN_H
+#define SPP_PLAN_H
+
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+
+namespace spp {
+
+class EvaluationContext;
+class Program;
+
+
+/**
+ * The output of an evaluation as a list of text fragments, in order.
+ *
+ * The fragments refer to the text of the evaluated program and to the define
+ * block of the EvaluationContext, so no output is copied. They can be passed
+ * on as a scatter/gather list, e.g. to writev() or glShaderSource().
+ *
+ * The fragments are valid for as long as the evaluated program exists and
+ * the context is neither modified nor destroyed.
+ */
+class Fragments
+{
+public:
+    typedef std::vector<std::string_view>::const_iterator const_iterator;
+
+public:
+    Fragments();
+
+private:
+    std::vector<std::string_view> m_fragments;
+    std::size_t m_size;
+
+    friend class EvaluationPlan;
+
+public:
+    inline const std::vector<std::string_view> &fragments() const
+    {
+        return m_fragments;
+    }
+
+    inline const_iterator begin() const
+    {
+        return m_fragments.cbegin();
+    }
+
+    inline const_iterator end() const
+    {
+        return m_fragments.cend();
+    }
+
+    /**
+     * Number of fragments.
+     */
+    inline std::size_t count() const
+    {
+        return m_fragments.size();
+    }
+
+    /**
+     * Total number of bytes in all fragments.
+     */
+    inline std::size_t size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * Concatenate the fragments.
+     */
+    std::string str() const;
+
+};
+
+
+/**
+ * A Program compiled for evaluation.
+ *
+ * The plan is a flat list of static text spans and slots for the define
+ * block, with includes already expanded. Since only the define block depends
+ * on the EvaluationContext, the exact size of the output is known before
+ * writing it, and the output is produced with a single allocation.
+ *
+ * The plan refers to the text of the program it was compiled from and must
+ * not outlive it.
+ *
+ * @see Program::plan()
+ */
+class EvaluationPlan
+{
+public:
+    /**
+     * Compile @a program.
+     *
+     * @throws std::runtime_error if the program contains unresolved include
+     * directives.
+     */
+    explicit EvaluationPlan(const Program &program);
+    EvaluationPlan(const EvaluationPlan &ref) = delete;
+    EvaluationPlan &operator=(const EvaluationPlan &ref) = delete;
+
+private:
+    struct Step
+    {
+        // empty text with is_define_block set marks the define block slot
+        std::string_view text;
+        bool is_define_block;
+    };
+
+    std::vector<Step> m_steps;
+    // generated text, e.g. version declarations
+    std::deque<std::string> m_generated;
+    std::size_t m_static_size;
+    std::size_t m_define_blocks;
+    // XXH64 of the static text between (and around) the define blocks
+    std::vector<std::uint64_t> m_segment_hashes;
+    std::uint64_t m_content_hash;
+
+private:
+    void compile(const Program &program,
+                 bool as_include,
+                 std::unordered_set<std::string_view> &expanded_once);
+    void append_static(std::string_view text);
+    void hash_segments();
+
+public:
+    /**
+     * Number of bytes of output not depending on the context.
+     */
+    inline std::size_t static_size() const
+    {
+        return m_static_size;
+    }
+
+    /**
+     * Hash of the output not depending on the context: two plans with the
+     * same content hash produce the same output for the same context.
+     */
+    inline std::uint64_t content_hash() const
+    {
+        return m_content_hash;
+    }
+
+    /**
+     * A stable 64 bit fingerprint of the output for @a ctx, computed without
+     * producing the output: it combines the cached hashes of the static text
+     * with the hash of the define block of @a ctx.
+     *
+     * Plans producing the same output for a context have the same
+     * fingerprint, independent of how the program was split into sections
+     * and files.
+     */
+    std::uint64_t fingerprint(const EvaluationContext &ctx) const;
+
+    /**
+     * Exact number of bytes produced when evaluating with @a ctx.
+     */
+    std::size_t size(const EvaluationContext &ctx) const;
+
+    /**
+     * Append the output to @a into, reserving the required space once.
+     */
+    void evaluate(const EvaluationContext &ctx, std::string &into) const;
+
+    std::string evaluate(const EvaluationContext &ctx) const;
+
+    /**
+     * Write the output to the buffer at @a dest, which has space for
+     * @a capacity bytes.
+     *
+     * @return the number of bytes written.
+     * @throws std::length_error if the output does not fit; nothing is
+     * written in that case.
+     */
+    std::size_t evaluate(const EvaluationContext &ctx,
+                         char *dest,
+                         std::size_t capacity) const;
+
+    void evaluate(const EvaluationContext &ctx, std::ostream &into) const;
+
+    /**
+     * Evaluate into fragments referring to the text of the program and the
+     * define block of @a ctx instead of copying them.
+     */
+    Fragments fragments(const EvaluationContext &ctx) const;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef SPP_SCAN_H
+#define SPP_SCAN_H
+
+#include <cstddef>
+#include <vector>
+
+
+namespace spp {
+
+/**
+ * Result of scan_code().
+ */
+struct CodeScan
+{
+    /**
+     * Start of the next directive opener (`{%`), or the end of the input.
+     */
+    const char *stop;
+
+    /**
+     * Number of newlines between the start of the scan and stop.
+     */
+    std::size_t newlines;
+
+    /**
+     * Last newline before stop, or nullptr if there is none.
+     */
+    const char *last_newline;
+};
+
+/**
+ * Skip static shader source from @a begin up to the next directive opener,
+ * counting the newlines on the way.
+ *
+ * Uses AVX2 or SSE2 if the CPU supports it and a scalar loop otherwise; all
+ * variants give the same result.
+ */
+CodeScan scan_code(const char *begin, const char *end);
+
+/**
+ * One implementation of scan_code().
+ */
+struct CodeScanImpl
+{
+    const char *name;
+    CodeScan (*scan)(const char *begin, const char *end);
+};
+
+/**
+ * The implementations of scan_code() which the CPU supports, the one
+ * scan_code() uses first. The scalar loop is always included. Meant for
+ * testing the variants against each other.
+ */
+std::vector<CodeScanImpl> supported_code_scans();
+
+}
+
+#endif
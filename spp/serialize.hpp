@@ -0,0 +1,97 @@
+#ifndef SPP_SERIALIZE_H
+#define SPP_SERIALIZE_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "spp/ast.hpp"
+#include "spp/buffer.hpp"
+
+
+namespace spp {
+
+/**
+ * A file a serialized program was built from.
+ */
+struct ProgramDependency
+{
+    std::string path;
+    // false if the file could not be opened
+    bool present;
+    std::uint64_t content_hash;
+};
+
+/**
+ * What a serialized program was built from. It is only valid as long as all
+ * dependencies still have the recorded content hashes and it was built with
+ * the same settings.
+ */
+struct ProgramManifest
+{
+    // hash of the settings which affect the resulting program
+    std::uint64_t settings;
+    // the program itself comes first, followed by everything it includes,
+    // directly or transitively
+    std::vector<ProgramDependency> dependencies;
+    // include directives as pairs of (includer, included) dependency indices
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > includes;
+};
+
+/**
+ * Serialize @a program and its @a manifest into a versioned binary format
+ * which can be read back by SerializedProgram.
+ *
+ * The format uses the byte order of the host; it is meant for caching, not
+ * for exchanging programs between machines.
+ */
+std::string serialize_program(const Program &program,
+                              const ProgramManifest &manifest);
+
+/**
+ * A program serialized by serialize_program().
+ *
+ * The sections of deserialized programs refer to the text in the buffer, so
+ * that a memory-mapped buffer (see SourceBuffer::map_file()) is only read as
+ * far as the program is actually used.
+ */
+class SerializedProgram
+{
+public:
+    typedef std::function<std::shared_ptr<const Program>(const std::string&)> IncludeResolver;
+
+public:
+    /**
+     * Read the manifest from @a buffer. Throws std::runtime_error if the
+     * buffer does not hold a program serialized in the current format.
+     */
+    explicit SerializedProgram(std::shared_ptr<const SourceBuffer> buffer);
+
+private:
+    std::shared_ptr<const SourceBuffer> m_buffer;
+    ProgramManifest m_manifest;
+    // where the program follows the manifest
+    std::size_t m_program_offset;
+
+public:
+    inline const ProgramManifest &manifest() const
+    {
+        return m_manifest;
+    }
+
+    /**
+     * Build the program. Programs referenced by lazily included sections
+     * are obtained from @a resolve; if it returns nullptr, or if the buffer
+     * is malformed, std::runtime_error is thrown.
+     */
+    std::unique_ptr<Program> deserialize(const IncludeResolver &resolve,
+                                         std::shared_ptr<Arena> arena = nullptr) const;
+
+};
+
+}
+
+#endif
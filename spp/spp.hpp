@@ -1,5 +1,14 @@
+#include "spp/arena.hpp"
 #include "spp/ast.hpp"
+#include "spp/buffer.hpp"
 #include "spp/context.hpp"
+#include "spp/hash.hpp"
 #include "spp/lexer.hpp"
 #include "spp/loader.hpp"
+#include "spp/permutation.hpp"
+#include "spp/plan.hpp"
+#include "spp/scan.hpp"
+#include "spp/serialize.hpp"
+#include "spp/threadpool.hpp"
+#include "spp/watcher.hpp"
 #include "parser.hpp"
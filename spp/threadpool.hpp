@@ -0,0 +1,98 @@
+#ifndef SPP_THREADPOOL_H
+#define SPP_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace spp {
+
+/**
+ * Work-stealing thread pool.
+ *
+ * Each worker has its own task queue. Workers take tasks from the back of
+ * their own queue and, when it is empty, steal from the front of the other
+ * queues. Threads waiting for a batch of tasks (see parallel_for()) help
+ * executing tasks instead of blocking.
+ */
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Task;
+
+public:
+    /**
+     * Create a pool with @a threads workers. With zero workers, all tasks
+     * are executed by the threads waiting for them.
+     */
+    explicit ThreadPool(unsigned int threads = std::thread::hardware_concurrency());
+    ThreadPool(const ThreadPool &ref) = delete;
+    ThreadPool &operator=(const ThreadPool &ref) = delete;
+    ThreadPool(ThreadPool &&src) = delete;
+    ThreadPool &operator=(ThreadPool &&src) = delete;
+
+    /**
+     * Wait for the queued tasks to finish and stop the workers.
+     */
+    ~ThreadPool();
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue> > m_queues;
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_wakeup_mutex;
+    std::condition_variable m_wakeup;
+    std::atomic<std::size_t> m_pending;
+    std::atomic<std::size_t> m_next_queue;
+    bool m_stopping;
+
+private:
+    bool pop_task(std::size_t own_queue, Task &task);
+    void worker_main(std::size_t index);
+
+public:
+    inline std::size_t size() const
+    {
+        return m_workers.size();
+    }
+
+    /**
+     * Queue @a task for execution by any worker.
+     */
+    void submit(Task &&task);
+
+    /**
+     * Execute one queued task on the calling thread, if there is one.
+     *
+     * @return true if a task was executed.
+     */
+    bool run_pending_task();
+
+    /**
+     * Call @a func(i) for each i in [0, @a count) in parallel and wait for
+     * all calls to finish. The calling thread takes part in the work.
+     *
+     * If any call throws, the first exception is rethrown after all calls
+     * finished.
+     */
+    void parallel_for(std::size_t count,
+                      const std::function<void(std::size_t)> &func);
+
+};
+
+}
+
+#endif
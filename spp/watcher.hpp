@@ -0,0 +1,67 @@
+#ifndef SPP_WATCHER_H
+#define SPP_WATCHER_H
+
+#ifdef __linux__
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace spp {
+
+class Library;
+class Program;
+
+/**
+ * Invalidates files in a Library when they change on disk, using inotify.
+ *
+ * The directories containing the watched files are watched instead of the
+ * files themselves, so that files which are replaced (as many editors do
+ * when saving) are picked up, too. Paths are passed to the Library as they
+ * were passed to watch(), so they must be the paths the files are loaded
+ * and included by.
+ *
+ * The watcher does not start a thread; call poll() regularly, e.g. once per
+ * frame.
+ */
+class LibraryWatcher
+{
+public:
+    explicit LibraryWatcher(Library &library);
+    LibraryWatcher(const LibraryWatcher &ref) = delete;
+    LibraryWatcher &operator=(const LibraryWatcher &ref) = delete;
+    LibraryWatcher(LibraryWatcher &&src) = delete;
+    LibraryWatcher &operator=(LibraryWatcher &&src) = delete;
+    ~LibraryWatcher();
+
+private:
+    Library &m_library;
+    int m_fd;
+    // watch descriptor -> file name -> paths of watched files
+    std::unordered_map<int, std::unordered_map<std::string, std::vector<std::string> > > m_files;
+    std::unordered_map<std::string, int> m_directories;
+
+public:
+    /**
+     * Watch the file at @a path. Throws std::system_error if the directory
+     * containing the file cannot be watched.
+     */
+    void watch(const std::string &path);
+
+    /**
+     * Invalidate the files which changed since the last call, waiting up to
+     * @a timeout_ms milliseconds for a change (-1 waits indefinitely).
+     *
+     * @return The programs reloaded by Library::invalidate().
+     */
+    std::vector<std::shared_ptr<const Program> > poll(int timeout_ms = 0);
+
+};
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,52 @@
+#include "spp/arena.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace spp {
+
+Arena::Arena(std::size_t block_size):
+    m_block_size(block_size),
+    m_blocks(),
+    m_head(nullptr),
+    m_end(nullptr),
+    m_bytes_used(0),
+    m_bytes_reserved(0)
+{
+
+}
+
+void *Arena::allocate(std::size_t size, std::size_t alignment)
+{
+    const std::uintptr_t head = reinterpret_cast<std::uintptr_t>(m_head);
+    std::size_t padding = (alignment - (head & (alignment - 1))) & (alignment - 1);
+
+    if (!m_head || static_cast<std::size_t>(m_end - m_head) < size + padding) {
+        // oversized requests get a block of their own
+        const std::size_t block_size = std::max(m_block_size, size);
+        m_blocks.emplace_back(new char[block_size]);
+        m_head = m_blocks.back().get();
+        m_end = m_head + block_size;
+        m_bytes_reserved += block_size;
+        // new[] returns memory aligned for any fundamental type
+        padding = 0;
+    }
+
+    void *result = m_head + padding;
+    m_head += padding + size;
+    m_bytes_used += padding + size;
+    return result;
+}
+
+std::string_view Arena::intern(std::string_view text)
+{
+    if (text.empty()) {
+        return std::string_view();
+    }
+    char *dest = static_cast<char*>(allocate(text.size(), 1));
+    std::memcpy(dest, text.data(), text.size());
+    return std::string_view(dest, text.size());
+}
+
+}
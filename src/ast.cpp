@@ -1,8 +1,10 @@
 #include "spp/ast.hpp"
 
+#include <algorithm>
 #include <iostream>
 
 #include "spp/context.hpp"
+#include "spp/plan.hpp"
 
 
 namespace spp {
@@ -76,104 +78,167 @@ std::tuple<bool, std::string> unescape(const std::string &src)
 }
 
 
-Section::Section(const location &location)
+Section::Section(SectionKind kind,
+                 const location &location,
+                 std::string_view text,
+                 unsigned int version,
+                 ProgramType type,
+                 const Program *program):
+    m_location(location),
+    m_text(text),
+    m_program(program),
+    m_version(version),
+    m_kind(kind),
+    m_type(type)
 {
 
 }
 
-Section::~Section()
+Section Section::version_declaration(const location &location,
+                                     unsigned int version,
+                                     std::string_view profile,
+                                     ProgramType type)
 {
+    return Section(SectionKind::VERSION, location, profile, version, type);
+}
 
+Section Section::static_source(const location &location,
+                               std::string_view source)
+{
+    return Section(SectionKind::STATIC_SOURCE, location, source);
 }
 
+Section Section::include_directive(const location &location,
+                                   std::string_view path)
+{
+    return Section(SectionKind::INCLUDE, location, path);
+}
 
-VersionDeclaration::VersionDeclaration(const location &location,
-                                       unsigned int version,
-                                       const std::string &profile,
-                                       ProgramType type):
-    Section(location),
-    m_version(version),
-    m_profile(profile),
-    m_type(type)
+Section Section::included_program(const location &location,
+                                  std::string_view path,
+                                  const Program *program)
 {
+    return Section(SectionKind::INCLUDED_PROGRAM, location, path, 0,
+                   ProgramType::GENERIC, program);
+}
 
+Section Section::include_once_directive(const location &location,
+                                        std::string_view path)
+{
+    return Section(SectionKind::INCLUDE_ONCE, location, path);
 }
 
-std::unique_ptr<Section> VersionDeclaration::copy() const
+Section Section::include_guard(const location &location,
+                               std::string_view path,
+                               unsigned int guarded)
 {
-    return std::make_unique<VersionDeclaration>(m_location,
-                                                m_version,
-                                                m_profile,
-                                                m_type);
+    return Section(SectionKind::INCLUDE_GUARD, location, path, guarded);
 }
 
-void VersionDeclaration::evaluate(std::ostream &into, EvaluationContext &ctx)
+void Section::extend(const location &until, std::size_t length)
 {
-    into << "#version " << m_version << " " << m_profile << std::endl;
-    for (auto &define: ctx.defines()) {
-        into << "#define " << std::get<0>(define) << " " << std::get<1>(define) << std::endl;
-    }
+    m_text = std::string_view(m_text.data(), m_text.size() + length);
+    m_location.end = until.end;
 }
 
 
-StaticSourceSection::StaticSourceSection(const location &location,
-                                         const std::string &source):
-    Section(location),
-    m_source(source)
+SectionSink::~SectionSink()
 {
 
 }
 
-std::unique_ptr<Section> StaticSourceSection::copy() const
+void SectionSink::include_once(const location &location, const std::string &path)
 {
-    return std::make_unique<StaticSourceSection>(m_location, m_source);
+    include(location, path);
 }
 
-void StaticSourceSection::evaluate(std::ostream &into, EvaluationContext &ctx)
+
+Program::Program(const std::string &source_path, std::shared_ptr<Arena> arena):
+    m_type(ProgramType::GENERIC),
+    m_source_path(source_path),
+    m_arena(std::move(arena)),
+    m_owned_bytes(0)
 {
-    into << m_source;
-}
 
+}
 
-IncludeDirective::IncludeDirective(const location &location,
-                                   const std::string &path):
-    Section(location),
-    m_path(path)
+Program::~Program()
 {
 
 }
 
-std::unique_ptr<Section> IncludeDirective::copy() const
+void Program::invalidate_plan()
 {
-    return std::make_unique<IncludeDirective>(m_location, m_path);
+    m_plan = nullptr;
 }
 
-void IncludeDirective::evaluate(std::ostream &into, EvaluationContext &ctx)
+void Program::add_local_error(const location &location, const std::string &msg)
 {
-    throw std::runtime_error("cannot evaluate IncludeDirective");
+    m_errors.emplace_back(m_source_path, location, msg);
 }
 
+void Program::add_error(const Program::RecordedError &ref)
+{
+    m_errors.emplace_back(ref);
+}
 
-Program::Program(const std::string &source_path):
-    m_type(ProgramType::GENERIC),
-    m_source_path(source_path)
+void Program::append_section(const Section &sec)
 {
+    invalidate_plan();
+    m_sections.emplace_back(sec);
+}
 
+void Program::append_source(const location &location, std::string_view source)
+{
+    invalidate_plan();
+    if (!m_sections.empty()) {
+        Section &last = m_sections.back();
+        if (last.kind() == SectionKind::STATIC_SOURCE &&
+                last.source().data() + last.source().size() == source.data())
+        {
+            last.extend(location, source.size());
+            return;
+        }
+    }
+    m_sections.emplace_back(Section::static_source(location, source));
 }
 
-void Program::add_local_error(const location &location, const std::string &msg)
+std::string_view Program::intern(std::string_view text)
 {
-    m_errors.emplace_back(m_source_path, location, msg);
+    if (m_arena) {
+        return m_arena->intern(text);
+    }
+    if (!m_strings) {
+        m_strings = std::make_shared<std::deque<std::string> >();
+    }
+    m_strings->emplace_back(text);
+    return m_strings->back();
 }
 
-void Program::add_error(const Program::RecordedError &ref)
+void Program::retain(const std::shared_ptr<const void> &storage)
 {
-    m_errors.emplace_back(ref);
+    if (!storage || !m_retained_index.insert(storage.get()).second) {
+        return;
+    }
+    m_retained.emplace_back(storage);
+}
+
+void Program::own_buffer(const std::shared_ptr<const SourceBuffer> &buffer)
+{
+    if (!buffer || !m_retained_index.insert(buffer.get()).second) {
+        return;
+    }
+    m_retained.emplace_back(buffer);
+    m_owned_bytes += buffer->size();
 }
 
-void Program::append_section(std::unique_ptr<Section> &&sec)
+void Program::share_storage(const Program &other)
 {
-    m_sections.emplace_back(std::move(sec));
+    for (auto &storage: other.m_retained) {
+        retain(storage);
+    }
+    retain(other.m_arena);
+    retain(other.m_strings);
 }
 
 void Program::set_type(ProgramType type)
@@ -181,31 +246,79 @@ void Program::set_type(ProgramType type)
     m_type = type;
 }
 
-Program::iterator Program::erase(Program::iterator iter)
+Program::const_iterator Program::erase(Program::const_iterator iter)
+{
+    invalidate_plan();
+    return m_sections.erase(iter);
+}
+
+Program::const_iterator Program::erase(Program::const_iterator first,
+                                       Program::const_iterator last)
+{
+    invalidate_plan();
+    return m_sections.erase(first, last);
+}
+
+Program::const_iterator Program::insert(Program::const_iterator before,
+                                        const Section &section)
 {
-    return Program::iterator(m_sections.erase(iter.m_curr));
+    invalidate_plan();
+    return m_sections.insert(before, section);
 }
 
-Program::iterator Program::insert(Program::iterator before, std::unique_ptr<Section> &&section)
+void Program::assign(std::vector<Section> &&sections)
 {
-    return Program::iterator(m_sections.emplace(before.m_curr, std::move(section)));
+    invalidate_plan();
+    m_sections = std::move(sections);
 }
 
 std::unique_ptr<Program> Program::copy() const
 {
+    // the copy retains the arena of this program (see share_storage()); it
+    // is not written to, since an arena is not thread-safe
     auto result = std::make_unique<Program>();
-    for (auto &section: m_sections) {
-        result->append_section(std::move(section->copy()));
+    result->share_storage(*this);
+    result->m_sections = m_sections;
+    return result;
+}
+
+std::size_t Program::memory_usage() const
+{
+    std::size_t bytes = sizeof(Program) + m_sections.capacity() * sizeof(Section);
+    bytes += m_owned_bytes;
+    if (m_arena) {
+        bytes += m_arena->bytes_used();
+    }
+    if (m_strings) {
+        for (const std::string &str: *m_strings) {
+            bytes += str.capacity();
+        }
     }
-    return std::move(result);
+    return bytes;
 }
 
-void Program::evaluate(std::ostream &into, EvaluationContext &ctx) const
+const EvaluationPlan &Program::plan() const
 {
-    for (auto &section: m_sections)
-    {
-        section->evaluate(into, ctx);
+    std::lock_guard<std::mutex> lock(m_plan_mutex);
+    if (!m_plan) {
+        m_plan = std::make_unique<EvaluationPlan>(*this);
     }
+    return *m_plan;
+}
+
+void Program::evaluate(std::ostream &into, EvaluationContext &ctx) const
+{
+    plan().evaluate(ctx, into);
+}
+
+std::uint64_t Program::fingerprint(const EvaluationContext &ctx) const
+{
+    return plan().fingerprint(ctx);
+}
+
+Fragments Program::evaluate(EvaluationContext &ctx) const
+{
+    return plan().fragments(ctx);
 }
 
 
@@ -0,0 +1,82 @@
+#include "spp/buffer.hpp"
+
+#include <fstream>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace spp {
+
+SourceBuffer::SourceBuffer(std::string &&data):
+    m_storage(std::move(data)),
+    m_data(m_storage.data()),
+    m_size(m_storage.size())
+{
+
+}
+
+SourceBuffer::SourceBuffer(const char *data, std::size_t size):
+    m_storage(),
+    m_data(data),
+    m_size(size)
+{
+
+}
+
+std::shared_ptr<const SourceBuffer> SourceBuffer::from_stream(std::istream &in)
+{
+    std::string data;
+    char chunk[16384];
+    while (in.read(chunk, sizeof(chunk)), in.gcount() > 0) {
+        data.append(chunk, in.gcount());
+    }
+    return std::make_shared<SourceBuffer>(std::move(data));
+}
+
+std::shared_ptr<const SourceBuffer> SourceBuffer::map_file(const std::string &path)
+{
+#ifdef __unix__
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    const std::size_t size = info.st_size;
+    if (size == 0) {
+        // empty mappings are not allowed
+        close(fd);
+        return std::make_shared<SourceBuffer>(std::string());
+    }
+
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after closing the descriptor
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return nullptr;
+    }
+
+    return std::shared_ptr<const SourceBuffer>(
+                new SourceBuffer(static_cast<const char*>(mapping), size),
+                [mapping, size](const SourceBuffer *buffer) {
+                    delete buffer;
+                    munmap(mapping, size);
+                });
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return nullptr;
+    }
+    return from_stream(in);
+#endif
+}
+
+}
@@ -1,14 +1,189 @@
 #include "spp/context.hpp"
+#include "spp/plan.hpp"
+#include "spp/serialize.hpp"
 
-#include <iomanip>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <random>
 #include <sstream>
+#include <thread>
 
 namespace spp {
 
+namespace {
+
+/**
+ * Append the sections in [@a first, @a last) to @a dest, leaving out the
+ * files included with include_once which are in @a expanded_once already.
+ * Guards around left out files are shrunk accordingly.
+ */
+void append_expanded(std::vector<Section> &dest,
+                     Program::const_iterator first,
+                     Program::const_iterator last,
+                     std::unordered_set<std::string> &expanded_once)
+{
+    while (first != last) {
+        if (first->kind() != SectionKind::INCLUDE_GUARD) {
+            dest.emplace_back(*first);
+            ++first;
+            continue;
+        }
+
+        const Section &guard = *first;
+        const auto guarded_end = first + 1 + guard.guarded();
+        if (expanded_once.emplace(guard.path()).second) {
+            const std::size_t guard_index = dest.size();
+            dest.emplace_back(guard);
+            append_expanded(dest, first + 1, guarded_end, expanded_once);
+            dest[guard_index] = Section::include_guard(
+                        guard.loc(), guard.path(), dest.size() - guard_index - 1);
+        }
+        first = guarded_end;
+    }
+}
+
+/**
+ * Upper bound for the length of a literal written by format_literal().
+ */
+constexpr std::size_t max_literal_size = 32;
+
+template <typename T>
+char *format_integer(char *dest, T value)
+{
+    return std::to_chars(dest, dest + max_literal_size, value).ptr;
+}
+
+/**
+ * Write the shortest representation of @a value which reads back as the same
+ * value, in a form GLSL parses as a floating point literal.
+ */
+template <typename T>
+char *format_float(char *dest, T value)
+{
+    if (!std::isfinite(value)) {
+        throw std::invalid_argument("GLSL has no literal for non-finite values");
+    }
+    char *end = std::to_chars(dest, dest + max_literal_size, value).ptr;
+    if (std::find_if(dest, end, [](char c){ return c == '.' || c == 'e'; }) == end) {
+        // "1" would be an integer literal
+        *end++ = '.';
+        *end++ = '0';
+    }
+    return end;
+}
+
+char *format_literal(char *dest, float value)
+{
+    return format_float(dest, value);
+}
+
+char *format_literal(char *dest, double value)
+{
+    // without the suffix, GLSL reads the literal as float
+    char *end = format_float(dest, value);
+    *end++ = 'l';
+    *end++ = 'f';
+    return end;
+}
+
+char *format_literal(char *dest, signed long long value)
+{
+    return format_integer(dest, value);
+}
+
+char *format_literal(char *dest, unsigned long long value)
+{
+    return format_integer(dest, value);
+}
+
+char *format_literal(char *dest, std::int32_t value)
+{
+    return format_integer(dest, value);
+}
+
+char *format_literal(char *dest, std::uint32_t value)
+{
+    char *end = format_integer(dest, value);
+    *end++ = 'u';
+    return end;
+}
+
+/**
+ * Sink which appends the sections to a Program.
+ */
+class ProgramBuilder: public SectionSink
+{
+public:
+    explicit ProgramBuilder(Program &dest):
+        m_dest(dest)
+    {
+
+    }
+
+private:
+    Program &m_dest;
+
+public:
+    void version(const location &location,
+                 unsigned int version,
+                 const std::string &profile,
+                 ProgramType type) override
+    {
+        m_dest.append_section(Section::version_declaration(
+                                  location, version, m_dest.intern(profile), type));
+        m_dest.set_type(type);
+    }
+
+    void source(const location &location, std::string_view text) override
+    {
+        m_dest.append_source(location, text);
+    }
+
+    void include(const location &location, const std::string &path) override
+    {
+        m_dest.append_section(Section::include_directive(
+                                  location, m_dest.intern(path)));
+    }
+
+    void include_once(const location &location, const std::string &path) override
+    {
+        m_dest.append_section(Section::include_once_directive(
+                                  location, m_dest.intern(path)));
+    }
+
+    void error(const location &location, const std::string &msg) override
+    {
+        m_dest.add_local_error(location, msg);
+    }
+
+};
+
+}
+
 ParserContext::ParserContext(std::istream &in, const std::string &source_path):
-    m_in(in),
+    m_in(&in),
+    m_buffer(),
     m_source_path(source_path),
-    m_scanner(*this, &m_in, nullptr),
+    m_scanner_type(ScannerType::FLEX),
+    m_arena_block_size(0),
+    m_scanner(),
+    m_errors()
+{
+
+}
+
+ParserContext::ParserContext(std::shared_ptr<const SourceBuffer> buffer,
+                             const std::string &source_path):
+    m_in(nullptr),
+    m_buffer(std::move(buffer)),
+    m_source_path(source_path),
+    m_scanner_type(ScannerType::FLEX),
+    m_arena_block_size(0),
+    m_scanner(),
     m_errors()
 {
 
@@ -19,16 +194,59 @@ ParserContext::~ParserContext()
 
 }
 
+void ParserContext::create_scanner()
+{
+    if (!m_buffer) {
+        // only the flex rules can read from a stream
+        m_scanner = std::make_unique<Scanner>(*this, m_in, nullptr);
+        return;
+    }
+
+    switch (m_scanner_type) {
+    case ScannerType::FLEX:
+    {
+        m_scanner = std::make_unique<Scanner>(*this,
+                                              m_buffer->data(),
+                                              m_buffer->size());
+        break;
+    }
+    case ScannerType::SIMD:
+    {
+        m_scanner = std::make_unique<SimdScanner>(*this,
+                                                  m_buffer->data(),
+                                                  m_buffer->size());
+        break;
+    }
+    }
+}
+
 std::unique_ptr<Program> ParserContext::parse()
 {
-    auto prog = std::make_unique<Program>(m_source_path);
-    Parser parser(*this, *prog);
+    if (!m_buffer) {
+        m_buffer = SourceBuffer::from_stream(*m_in);
+    }
+    create_scanner();
+
+    auto prog = std::make_unique<Program>(
+                m_source_path,
+                m_arena_block_size > 0 ? std::make_shared<Arena>(m_arena_block_size) : nullptr);
+    prog->own_buffer(m_buffer);
+    ProgramBuilder builder(*prog);
+    Parser parser(*this, builder);
     if (parser.parse() != 0) {
         return nullptr;
     }
     return prog;
 }
 
+bool ParserContext::parse(SectionSink &sink)
+{
+    create_scanner();
+
+    Parser parser(*this, sink);
+    return parser.parse() == 0;
+}
+
 Library::Library():
     Library(std::make_unique<DefaultLoader>())
 {
@@ -37,49 +255,392 @@ Library::Library():
 
 Library::Library(std::unique_ptr<Loader> &&loader):
     m_max_include_depth(100),
-    m_loader(std::move(loader))
+    m_scanner_type(ScannerType::FLEX),
+    m_arena_block_size(0),
+    m_lazy_includes(false),
+    m_loader(std::move(loader)),
+    m_program_budget(0),
+    m_program_bytes(0),
+    m_program_clock(0),
+    m_program_hits(0),
+    m_program_misses(0),
+    m_program_evictions(0),
+    m_program_scans(0),
+    m_program_rescan_bytes(0),
+    m_prefetching(0),
+    m_evaluation_budget(0),
+    m_evaluation_bytes(0)
 {
 
 }
 
 Library::~Library()
 {
+    // scheduled loads refer to this library
+    std::unique_lock<std::mutex> lock(m_prefetch_mutex);
+    while (m_prefetching > 0) {
+        lock.unlock();
+        if (!m_pool || !m_pool->run_pending_task()) {
+            lock.lock();
+            m_prefetch_done.wait_for(lock, std::chrono::milliseconds(10));
+            continue;
+        }
+        lock.lock();
+    }
+}
+
+Library::CacheShard &Library::cache_shard(const std::string &path)
+{
+    return m_cache[std::hash<std::string>()(path) % cache_shard_count];
+}
+
+bool Library::claim_load(const std::string &path,
+                         const LoadChain &chain,
+                         PendingLoad &pending)
+{
+    std::lock_guard<std::mutex> lock(m_wait_mutex);
+    if (pending.claimed) {
+        return false;
+    }
+    pending.claimed = true;
+    m_loading[path] = &chain;
+    return true;
+}
+
+void Library::wait_for_load(const LoadChain &chain,
+                            const std::string &path,
+                            const CacheEntry &entry)
+{
+    if (entry.program.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_wait_mutex);
+        // follow the chain loading the path, the path it waits for, the chain
+        // loading that one and so on; reaching this chain means that files
+        // include each other across threads
+        auto loading = m_loading.find(path);
+        while (loading != m_loading.end()) {
+            if (loading->second == &chain) {
+                throw std::runtime_error("recursive inclusion detected");
+            }
+            auto waiting = m_waiting.find(loading->second);
+            if (waiting == m_waiting.end()) {
+                break;
+            }
+            loading = m_loading.find(waiting->second);
+        }
+        m_waiting[&chain] = path;
+    }
+
+    entry.program.wait();
+
+    std::lock_guard<std::mutex> lock(m_wait_mutex);
+    m_waiting.erase(&chain);
+}
+
+void Library::prefetch(const std::string &path,
+                       const std::string &open_path,
+                       const std::vector<std::string> &stack)
+{
+    if (stack.size() > m_max_include_depth ||
+            std::find(stack.begin(), stack.end(), path) != stack.end())
+    {
+        // leave reporting the error to the include resolution
+        return;
+    }
+
+    auto pending = std::make_shared<PendingLoad>();
+    pending->stack = stack;
+    pending->open_path = open_path;
+    pending->claimed = false;
+    {
+        CacheShard &shard = cache_shard(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.entries.count(path)) {
+            return;
+        }
+        shard.entries.emplace(path, CacheEntry{pending->promise.get_future().share(), pending, 0, 0});
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_prefetch_mutex);
+        ++m_prefetching;
+    }
+
+    m_pool->submit([this, path, pending]() {
+        LoadChain chain{pending->stack};
+        if (claim_load(path, chain, *pending)) {
+            try {
+                run_load(path, chain, *pending);
+            } catch (...) {
+                // reported to whoever needs the program
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_prefetch_mutex);
+        --m_prefetching;
+        m_prefetch_done.notify_all();
+    });
+}
+
+std::vector<std::string> Library::canonical_includes(const Program &program)
+{
+    // canonical() may have to ask the file system, so it runs once per include
+    std::vector<std::string> result;
+    for (const Section &section: program) {
+        if (section.kind() == SectionKind::INCLUDE ||
+                section.kind() == SectionKind::INCLUDE_ONCE)
+        {
+            result.emplace_back(m_loader->canonical(std::string(section.path())));
+        }
+    }
+    return result;
+}
+
+void Library::prefetch_includes(const Program &program,
+                                const std::vector<std::string> &include_paths,
+                                const LoadChain &chain)
+{
+    auto path = include_paths.begin();
+    for (const Section &section: program) {
+        if (section.kind() == SectionKind::INCLUDE ||
+                section.kind() == SectionKind::INCLUDE_ONCE)
+        {
+            prefetch(*path++, std::string(section.path()), chain.stack);
+        }
+    }
+}
+
+void Library::record_include(const std::string &includer, const std::string &included)
+{
+    std::lock_guard<std::mutex> lock(m_graph_mutex);
+    m_includes[includer].insert(included);
+    m_includers[included].insert(includer);
+}
+
+std::optional<std::uint64_t> Library::content_hash(const std::string &path)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_graph_mutex);
+        auto iter = m_content_hashes.find(path);
+        if (iter != m_content_hashes.end()) {
+            return iter->second;
+        }
+    }
+
+    std::optional<std::uint64_t> hash = m_loader->content_hash(path);
+    std::lock_guard<std::mutex> lock(m_graph_mutex);
+    m_content_hashes[path] = hash;
+    return hash;
+}
+
+std::uint64_t Library::settings_hash() const
+{
+    XXH64Stream hash;
+    hash.update_u64(m_lazy_includes);
+    hash.update_u64(m_max_include_depth);
+    return hash.digest();
+}
+
+std::string Library::disk_cache_path(const std::string &path) const
+{
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx",
+                  static_cast<unsigned long long>(xxh64(path)));
+    return m_disk_cache + "/" + name + ".sppc";
+}
+
+std::shared_ptr<Program> Library::load_from_disk_cache(const std::string &path,
+                                                       LoadChain &chain)
+{
+    std::shared_ptr<const SourceBuffer> buffer = SourceBuffer::map_file(disk_cache_path(path));
+    if (!buffer) {
+        return nullptr;
+    }
+
+    try {
+        SerializedProgram serialized(buffer);
+        const ProgramManifest &manifest = serialized.manifest();
+        if (manifest.settings != settings_hash() ||
+                manifest.dependencies.empty() ||
+                manifest.dependencies[0].path != path)
+        {
+            return nullptr;
+        }
+        for (auto &dependency: manifest.dependencies) {
+            const std::optional<std::uint64_t> hash = content_hash(dependency.path);
+            if (hash.has_value() != dependency.present ||
+                    (hash && *hash != dependency.content_hash))
+            {
+                // stale
+                return nullptr;
+            }
+        }
+
+        chain.stack.push_back(path);
+        std::shared_ptr<Program> program;
+        try {
+            program = serialized.deserialize(
+                        [this, &chain](const std::string &included) {
+                            return _load(included, chain);
+                        });
+        } catch (...) {
+            chain.stack.pop_back();
+            throw;
+        }
+        chain.stack.pop_back();
+
+        for (auto &include: manifest.includes) {
+            record_include(manifest.dependencies[include.first].path,
+                           manifest.dependencies[include.second].path);
+        }
+        return program;
+    } catch (const std::runtime_error &) {
+        // unreadable entries are parsed again and overwritten
+        return nullptr;
+    }
+}
+
+void Library::write_to_disk_cache(const std::string &path, const Program &program)
+{
+    ProgramManifest manifest;
+    manifest.settings = settings_hash();
+
+    std::vector<std::string> files{path};
+    {
+        std::lock_guard<std::mutex> lock(m_graph_mutex);
+        std::unordered_map<std::string, std::uint32_t> indices{{path, 0}};
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            auto iter = m_includes.find(files[i]);
+            if (iter == m_includes.end()) {
+                continue;
+            }
+            for (auto &included: iter->second) {
+                auto index = indices.emplace(included, files.size());
+                if (index.second) {
+                    files.push_back(included);
+                }
+                manifest.includes.emplace_back(i, index.first->second);
+            }
+        }
+    }
+
+    for (auto &file: files) {
+        const std::optional<std::uint64_t> hash = content_hash(file);
+        manifest.dependencies.push_back(ProgramDependency{file, hash.has_value(), hash.value_or(0)});
+    }
+
+    // write to a temporary file first, so that other processes never see a
+    // partially written entry
+    const std::string cache_path = disk_cache_path(path);
+    std::ostringstream tmp_path;
+    tmp_path << cache_path << "." << std::hex << std::random_device()() << ".tmp";
+    {
+        std::ofstream out(tmp_path.str(), std::ios::binary | std::ios::trunc);
+        const std::string data = serialize_program(program, manifest);
+        out.write(data.data(), data.size());
+        if (!out) {
+            // the disk cache is best effort
+            out.close();
+            std::remove(tmp_path.str().c_str());
+            return;
+        }
+    }
+    if (std::rename(tmp_path.str().c_str(), cache_path.c_str()) != 0) {
+        std::remove(tmp_path.str().c_str());
+    }
+}
+
+std::shared_ptr<Program> Library::find_duplicate(const std::string &path,
+                                                 const std::string &open_path,
+                                                 const SourceBuffer &buffer,
+                                                 std::uint64_t hash)
+{
+    std::lock_guard<std::mutex> lock(m_graph_mutex);
+    auto iter = m_programs_by_content.find(hash);
+    if (iter == m_programs_by_content.end()) {
+        return nullptr;
+    }
+
+    std::shared_ptr<const SourceBuffer> original_buffer = iter->second.buffer.lock();
+    std::shared_ptr<const Program> original = iter->second.program.lock();
+    if (!original || !original_buffer) {
+        m_programs_by_content.erase(iter);
+        return nullptr;
+    }
+    if (original_buffer->view() != buffer.view()) {
+        // hash collision
+        return nullptr;
+    }
 
+    // includes do not depend on the path of the includer, so the resolved
+    // sections can be shared as they are
+    // nothing is interned into the copy, so it shares the original's
+    // storage instead of getting an arena of its own
+    auto program = std::make_shared<Program>(open_path);
+    program->share_storage(*original);
+    program->set_type(original->type());
+    program->assign(std::vector<Section>(original->cbegin(), original->cend()));
+
+    auto includes = m_includes.find(iter->second.path);
+    if (includes != m_includes.end()) {
+        const std::unordered_set<std::string> copied = includes->second;
+        for (auto &included: copied) {
+            m_includes[path].insert(included);
+            m_includers[included].insert(path);
+        }
+    }
+    return program;
 }
 
-void Library::resolve_includes(Program *in_program, unsigned int depth)
+void Library::resolve_includes(Program *in_program,
+                               const std::vector<std::string> &include_paths,
+                               LoadChain &chain)
 {
-    for (auto iter = in_program->begin();
-         iter != in_program->end();
-         ++iter)
+    // build the flattened section list in one pass instead of splicing the
+    // included sections into the middle of the program
+    std::vector<Section> resolved;
+    resolved.reserve(in_program->size());
+    // files included with include_once which are already part of the program
+    std::unordered_set<std::string> expanded_once;
+    auto include_path = include_paths.begin();
+
+    for (const Section &section: *in_program)
     {
-        IncludeDirective *include = dynamic_cast<IncludeDirective*>(&(*iter));
-        if (!include) {
+        if (section.kind() != SectionKind::INCLUDE &&
+                section.kind() != SectionKind::INCLUDE_ONCE)
+        {
+            resolved.emplace_back(section);
             continue;
         }
 
-        const Program *included = nullptr;
+        const std::string open_path(section.path());
+        const std::string &path = *include_path++;
+        // recorded even if the include fails, so that the includer is
+        // reloaded once the file is fixed
+        record_include(chain.stack.back(), path);
+
+        const bool once = section.kind() == SectionKind::INCLUDE_ONCE;
+        if (once && expanded_once.count(path)) {
+            continue;
+        }
+
+        std::shared_ptr<const Program> included;
         try {
-            included = _load(include->path(), depth);
+            included = _load(path, open_path, chain);
         } catch (const std::runtime_error &err) {
             // include failed, this can be e.g. due to too deep recursion
             in_program->add_local_error(
-                        include->loc(),
+                        section.loc(),
                         std::string("failed to load included file: ")+err.what());
-            iter = in_program->erase(iter);
-            if (iter == in_program->end()) {
-                break;
-            }
             continue;
         }
 
         if (!included) {
-            in_program->add_local_error(include->loc(),
+            in_program->add_local_error(section.loc(),
                                         "failed to load included file");
-            iter = in_program->erase(iter);
-            if (iter == in_program->end()) {
-                break;
-            }
             continue;
         }
 
@@ -88,115 +649,646 @@ void Library::resolve_includes(Program *in_program, unsigned int depth)
                 in_program->add_error(error);
             }
             // include failed
-            iter = in_program->erase(iter);
-            if (iter == in_program->end()) {
-                break;
+            continue;
+        }
+
+        std::string_view guard_path;
+        if (once) {
+            expanded_once.insert(path);
+            guard_path = in_program->intern(path);
+        }
+
+        if (m_lazy_includes) {
+            // the evaluation plan skips repeated files in lazily included
+            // programs
+            in_program->retain(included);
+            if (once) {
+                resolved.emplace_back(Section::include_guard(section.loc(), guard_path, 1));
             }
+            resolved.emplace_back(Section::included_program(
+                                      section.loc(), section.path(), included.get()));
             continue;
         }
 
-        iter = in_program->erase(iter);
+        // the copied sections refer to the text of the included program
+        in_program->share_storage(*included);
 
+        const std::size_t guard_index = resolved.size();
+        if (once) {
+            resolved.emplace_back(Section::include_guard(section.loc(), guard_path, 0));
+        }
         // we can safely +1 here, because a valid program always has a version
         // declaration and invalid programs have at least one error.
-        for (auto included_iter = ++included->cbegin();
-             included_iter != included->cend();
-             ++included_iter)
-        {
-            iter = ++in_program->insert(iter, (*included_iter).copy());
+        append_expanded(resolved, ++included->cbegin(), included->cend(), expanded_once);
+        if (once) {
+            resolved[guard_index] = Section::include_guard(
+                        section.loc(), guard_path, resolved.size() - guard_index - 1);
         }
+    }
 
-        if (iter == in_program->end()) {
-            break;
+    in_program->assign(std::move(resolved));
+}
+
+std::shared_ptr<Program> Library::parse_and_resolve(const std::string &path,
+                                                    const std::string &open_path,
+                                                    LoadChain &chain)
+{
+    if (!m_disk_cache.empty()) {
+        std::shared_ptr<Program> program = load_from_disk_cache(path, chain);
+        if (program) {
+            return program;
+        }
+    }
+
+    std::shared_ptr<const SourceBuffer> buffer = m_loader->open_buffer(open_path);
+    if (!buffer) {
+        return nullptr;
+    }
+
+    const std::uint64_t hash = xxh64(buffer->view());
+    {
+        std::lock_guard<std::mutex> lock(m_graph_mutex);
+        m_content_hashes[path] = hash;
+    }
+
+    std::shared_ptr<Program> duplicate = find_duplicate(path, open_path, *buffer, hash);
+    if (duplicate) {
+        return duplicate;
+    }
+
+    ParserContext parser(buffer, open_path);
+    parser.set_scanner_type(m_scanner_type);
+    parser.set_arena_block_size(m_arena_block_size);
+
+    std::shared_ptr<Program> program = parser.parse();
+    if (!program) {
+        return nullptr;
+    }
+
+    const std::vector<std::string> include_paths = canonical_includes(*program);
+    chain.stack.push_back(path);
+    try {
+        if (m_pool) {
+            prefetch_includes(*program, include_paths, chain);
         }
+        resolve_includes(program.get(), include_paths, chain);
+    } catch (...) {
+        chain.stack.pop_back();
+        throw;
+    }
+    chain.stack.pop_back();
+
+    if (program->errors().empty()) {
+        std::lock_guard<std::mutex> lock(m_graph_mutex);
+        m_programs_by_content[hash] = ContentEntry{path, buffer, program};
     }
+
+    if (!m_disk_cache.empty()) {
+        write_to_disk_cache(path, *program);
+    }
+
+    return program;
+}
+
+std::shared_ptr<const Program> Library::_load(const std::string &requested_path,
+                                              LoadChain &chain)
+{
+    return _load(m_loader->canonical(requested_path), requested_path, chain);
 }
 
-const Program *Library::_load(const std::string &path, unsigned int depth)
+std::shared_ptr<const Program> Library::_load(const std::string &path,
+                                              const std::string &requested_path,
+                                              LoadChain &chain)
 {
-    if (depth > m_max_include_depth) {
+    if (chain.stack.size() > m_max_include_depth) {
         throw std::runtime_error("maximum include depth exceeded");
     }
 
+    if (std::find(chain.stack.begin(), chain.stack.end(), path) != chain.stack.end()) {
+        throw std::runtime_error("recursive inclusion detected");
+    }
+
+    CacheShard &shard = cache_shard(path);
+    std::shared_ptr<PendingLoad> pending;
+    CacheEntry existing;
     {
-        auto iter = m_cache.find(path);
-        if (iter != m_cache.end()) {
-            if (!iter->second) {
-                throw std::runtime_error("recursive inclusion detected");
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto iter = shard.entries.find(path);
+        if (iter != shard.entries.end()) {
+            iter->second.last_use = ++m_program_clock;
+            existing = iter->second;
+            ++m_program_hits;
+        } else {
+            ++m_program_misses;
+            // this chain loads the file, everyone else waits for it; the
+            // entry must be claimed before others can see it
+            pending = std::make_shared<PendingLoad>();
+            pending->stack = chain.stack;
+            pending->open_path = requested_path;
+            pending->claimed = true;
+            {
+                std::lock_guard<std::mutex> wait_lock(m_wait_mutex);
+                m_loading[path] = &chain;
             }
-            return iter->second.get();
+            shard.entries.emplace(path, CacheEntry{pending->promise.get_future().share(), pending, 0, 0});
         }
     }
 
-    std::unique_ptr<std::istream> input(m_loader->open(path));
-    if (!input) {
-        return nullptr;
+    if (existing.pending && claim_load(path, chain, *existing.pending)) {
+        // scheduled, but nobody started loading it yet
+        return run_load(path, chain, *existing.pending);
+    }
+    if (existing.program.valid()) {
+        wait_for_load(chain, path, existing);
+        return existing.program.get();
     }
 
-    ParserContext parser(*input, path);
+    return run_load(path, chain, *pending);
+}
 
-    // mark the file as being loaded in the cache
-    m_cache[path] = nullptr;
+std::shared_ptr<Program> Library::run_load(const std::string &path,
+                                           LoadChain &chain,
+                                           PendingLoad &pending)
+{
+    std::shared_ptr<Program> program;
+    std::exception_ptr error;
+    try {
+        program = parse_and_resolve(path, pending.open_path, chain);
+    } catch (...) {
+        error = std::current_exception();
+    }
 
-    auto program = parser.parse();
-    if (!program) {
-        return nullptr;
+    {
+        std::lock_guard<std::mutex> wait_lock(m_wait_mutex);
+        m_loading.erase(path);
     }
 
+    {
+        CacheShard &shard = cache_shard(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto iter = shard.entries.find(path);
+        // the entry may have been invalidated in the meantime
+        if (iter != shard.entries.end() && iter->second.pending.get() == &pending) {
+            if (!program) {
+                // do not cache failures, the file may become loadable later
+                shard.entries.erase(iter);
+            } else {
+                // the load is done, nothing left to claim
+                iter->second.pending = nullptr;
+                iter->second.bytes = program->memory_usage();
+                iter->second.last_use = ++m_program_clock;
+                m_program_bytes += iter->second.bytes;
+            }
+        }
+    }
 
-    Program *result = program.get();
-    resolve_includes(result, depth+1);
-    m_cache[path] = std::move(program);
+    if (error) {
+        pending.promise.set_exception(error);
+        std::rethrow_exception(error);
+    }
+    pending.promise.set_value(program);
 
-    return result;
+    const std::size_t budget = m_program_budget;
+    if (budget > 0 && m_program_bytes > budget &&
+            m_program_bytes >= m_program_rescan_bytes)
+    {
+        evict_programs();
+    }
+    return program;
 }
 
 const Program *Library::load(const std::string &path)
 {
-    return _load(path, 0);
+    return acquire(path).get();
 }
 
-EvaluationContext::EvaluationContext(Library &library):
-    m_library(library)
+std::shared_ptr<const Program> Library::acquire(const std::string &requested_path)
+{
+    const std::string path = m_loader->canonical(requested_path);
+    {
+        std::lock_guard<std::mutex> lock(m_graph_mutex);
+        m_roots[path] = requested_path;
+    }
+    LoadChain chain;
+    return _load(path, requested_path, chain);
+}
+
+std::vector<Library::PreloadFailure> Library::preload(const std::vector<std::string> &paths,
+                                                     unsigned int threads)
+{
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    std::vector<PreloadFailure> results(paths.size());
+    // the calling thread takes part in the work
+    const std::size_t workers = std::min<std::size_t>(threads, paths.size());
+    ThreadPool pool(workers > 0 ? workers - 1 : 0);
+    pool.parallel_for(paths.size(), [this, &paths, &results](std::size_t i) {
+        PreloadFailure &result = results[i];
+        result.path = paths[i];
+        try {
+            std::shared_ptr<const Program> program = acquire(paths[i]);
+            if (!program) {
+                result.errors.emplace_back(paths[i], location(), "failed to load file");
+            } else {
+                result.errors = program->errors();
+            }
+        } catch (const std::runtime_error &err) {
+            result.errors.emplace_back(paths[i], location(),
+                                       std::string("failed to load file: ") + err.what());
+        }
+    });
+
+    results.erase(std::remove_if(results.begin(), results.end(),
+                                 [](const PreloadFailure &result) {
+                                     return result.errors.empty();
+                                 }),
+                  results.end());
+    return results;
+}
+
+std::vector<Library::PreloadFailure> Library::preload_manifest(const std::string &manifest_path,
+                                                              unsigned int threads)
 {
+    std::unique_ptr<std::istream> manifest(m_loader->open(manifest_path));
+    if (!manifest || !*manifest) {
+        throw std::runtime_error("failed to open preload manifest: " + manifest_path);
+    }
 
+    std::vector<std::string> paths;
+    std::string line;
+    while (std::getline(*manifest, line)) {
+        const std::size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') {
+            continue;
+        }
+        const std::size_t last = line.find_last_not_of(" \t\r");
+        paths.emplace_back(line, first, last - first + 1);
+    }
+    return preload(paths, threads);
 }
 
-void EvaluationContext::define(const std::string &name, const std::string &rhs)
+std::vector<std::shared_ptr<const Program> > Library::invalidate(const std::string &changed_path)
 {
+    const std::string path = m_loader->canonical(changed_path);
+    std::vector<std::string> affected{path};
+    std::vector<std::pair<std::string, std::string> > roots;
     {
-        auto iter = m_define_names.find(name);
-        if (iter != m_define_names.end()) {
-            throw std::invalid_argument("duplicate define " + name);
+        std::lock_guard<std::mutex> lock(m_graph_mutex);
+        std::unordered_set<std::string> seen{path};
+        for (std::size_t i = 0; i < affected.size(); ++i) {
+            auto iter = m_includers.find(affected[i]);
+            if (iter == m_includers.end()) {
+                continue;
+            }
+            for (auto &includer: iter->second) {
+                if (seen.insert(includer).second) {
+                    affected.push_back(includer);
+                }
+            }
+        }
+
+        m_content_hashes.erase(path);
+        // the dropped programs must not be shared with new copies
+        for (auto iter = m_programs_by_content.begin(); iter != m_programs_by_content.end(); ) {
+            if (seen.count(iter->second.path)) {
+                iter = m_programs_by_content.erase(iter);
+            } else {
+                ++iter;
+            }
         }
+        for (auto &file: affected) {
+            auto root = m_roots.find(file);
+            if (root != m_roots.end()) {
+                roots.emplace_back(*root);
+            }
+            // the includes of the reloaded files are recorded again
+            auto iter = m_includes.find(file);
+            if (iter == m_includes.end()) {
+                continue;
+            }
+            for (auto &included: iter->second) {
+                m_includers[included].erase(file);
+            }
+            m_includes.erase(iter);
+        }
+    }
+
+    for (auto &file: affected) {
+        CacheShard &shard = cache_shard(file);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto iter = shard.entries.find(file);
+        if (iter != shard.entries.end()) {
+            m_program_bytes -= iter->second.bytes;
+            shard.entries.erase(iter);
+        }
+    }
+
+    std::sort(roots.begin(), roots.end());
+    std::vector<std::shared_ptr<const Program> > reloaded;
+    reloaded.reserve(roots.size());
+    for (auto &root: roots) {
+        LoadChain chain;
+        reloaded.emplace_back(_load(root.first, root.second, chain));
     }
+    return reloaded;
+}
 
-    m_define_names.insert(name);
+std::shared_ptr<const std::string> Library::evaluate(const Program &program,
+                                                     const EvaluationContext &ctx)
+{
+    const EvaluationPlan &plan = program.plan();
+    const EvaluationKey key{plan.content_hash(), ctx.define_block_hash()};
+    {
+        std::lock_guard<std::mutex> lock(m_evaluation_mutex);
+        auto iter = m_evaluation_cache.find(key);
+        if (iter != m_evaluation_cache.end()) {
+            m_evaluation_lru.splice(m_evaluation_lru.begin(), m_evaluation_lru, iter->second);
+            return iter->second->second;
+        }
+    }
+
+    // render without holding the lock
+    auto result = std::make_shared<const std::string>(plan.evaluate(ctx));
+
+    std::lock_guard<std::mutex> lock(m_evaluation_mutex);
+    // also covers the disabled cache with a budget of zero
+    if (result->size() > m_evaluation_budget || m_evaluation_budget == 0) {
+        return result;
+    }
+
+    auto iter = m_evaluation_cache.find(key);
+    if (iter != m_evaluation_cache.end()) {
+        // another thread was faster
+        m_evaluation_lru.splice(m_evaluation_lru.begin(), m_evaluation_lru, iter->second);
+        return iter->second->second;
+    }
+
+    m_evaluation_lru.emplace_front(key, result);
+    m_evaluation_cache.emplace(key, m_evaluation_lru.begin());
+    m_evaluation_bytes += result->size();
+    evict_evaluations();
+
+    return result;
+}
+
+void Library::evict_evaluations()
+{
+    while (m_evaluation_bytes > m_evaluation_budget) {
+        auto &oldest = m_evaluation_lru.back();
+        m_evaluation_bytes -= oldest.second->size();
+        m_evaluation_cache.erase(oldest.first);
+        m_evaluation_lru.pop_back();
+    }
+}
+
+bool Library::is_unreferenced(const CacheEntry &entry)
+{
+    // the promise is fulfilled right after the entry is accounted
+    return entry.program.wait_for(std::chrono::seconds(0)) == std::future_status::ready &&
+            entry.program.get().use_count() == 1;
+}
+
+void Library::evict_programs()
+{
+    std::unique_lock<std::mutex> eviction_lock(m_program_eviction_mutex, std::try_to_lock);
+    if (!eviction_lock.owns_lock()) {
+        // someone else is already evicting
+        return;
+    }
+
+    struct Candidate
+    {
+        std::uint64_t last_use;
+        CacheShard *shard;
+        std::string path;
+    };
+
+    ++m_program_scans;
+    // programs referenced by nothing but their cache entry
+    std::vector<Candidate> candidates;
+    for (CacheShard &shard: m_cache) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto &entry: shard.entries) {
+            if (entry.second.bytes > 0 && is_unreferenced(entry.second)) {
+                candidates.push_back(Candidate{entry.second.last_use, &shard, entry.first});
+            }
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate &a, const Candidate &b) { return a.last_use < b.last_use; });
+
+    for (auto &candidate: candidates) {
+        if (m_program_bytes <= m_program_budget) {
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(candidate.shard->mutex);
+        auto iter = candidate.shard->entries.find(candidate.path);
+        // skip entries which were used or replaced in the meantime
+        if (iter == candidate.shard->entries.end() ||
+                iter->second.last_use != candidate.last_use ||
+                !is_unreferenced(iter->second))
+        {
+            continue;
+        }
+        m_program_bytes -= iter->second.bytes;
+        candidate.shard->entries.erase(iter);
+        ++m_program_evictions;
+    }
+
+    // everything else is in use; scanning again on every load would take
+    // quadratic time, so let the cache grow a bit first
+    const std::size_t bytes = m_program_bytes;
+    m_program_rescan_bytes = bytes > m_program_budget ? bytes + bytes / 8 + 1 : 0;
+}
+
+void Library::set_program_cache_budget(std::size_t bytes)
+{
+    m_program_budget = bytes;
+    m_program_rescan_bytes = 0;
+    if (bytes > 0 && m_program_bytes > bytes) {
+        evict_programs();
+    }
+}
+
+Library::ProgramCacheStats Library::program_cache_stats() const
+{
+    return ProgramCacheStats{m_program_hits, m_program_misses, m_program_evictions,
+                             m_program_bytes, m_program_scans};
+}
+
+void Library::set_evaluation_cache_budget(std::size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_evaluation_mutex);
+    m_evaluation_budget = bytes;
+    evict_evaluations();
+}
+
+EvaluationContext::EvaluationContext(Library &library):
+    m_library(library),
+    m_define_block(),
+    m_defines(),
+    m_define_index(),
+    m_define_block_hash(0)
+{
+
+}
+
+void EvaluationContext::define(std::string_view name, std::string_view rhs)
+{
+    const std::size_t name_hash = std::hash<std::string_view>()(name);
+    auto candidates = m_define_index.equal_range(name_hash);
+    for (auto iter = candidates.first; iter != candidates.second; ++iter) {
+        if (std::get<0>(m_defines[iter->second]) == name) {
+            throw std::invalid_argument("duplicate define " + std::string(name));
+        }
+    }
+
+    static const std::string_view prefix("#define ");
+    m_define_block.reserve(m_define_block.size() + prefix.size() +
+                           name.size() + rhs.size() + 2);
+    m_define_block.append(prefix.data(), prefix.size());
+    const std::size_t name_offset = m_define_block.size();
+    m_define_block.append(name.data(), name.size());
+    m_define_block.push_back(' ');
+    m_define_block.append(rhs.data(), rhs.size());
+    m_define_block.push_back('\n');
+    m_define_block_hash.update(std::string_view(m_define_block).substr(name_offset - prefix.size()));
+
+    m_define_index.emplace(name_hash, m_defines.size());
     m_defines.emplace_back(name, rhs);
 }
 
-void EvaluationContext::define1ull(const std::string &name, const unsigned long long value)
+void EvaluationContext::define1ull(std::string_view name, const unsigned long long value)
+{
+    char buffer[max_literal_size];
+    define(name, std::string_view(buffer, format_literal(buffer, value) - buffer));
+}
+
+void EvaluationContext::define1ll(std::string_view name, const signed long long value)
 {
-    define(name, std::to_string(value));
+    char buffer[max_literal_size];
+    define(name, std::string_view(buffer, format_literal(buffer, value) - buffer));
 }
 
-void EvaluationContext::define1ll(const std::string &name, const signed long long value)
+void EvaluationContext::define1f(std::string_view name, const float value)
 {
-    define(name, std::to_string(value));
+    char buffer[max_literal_size];
+    define(name, std::string_view(buffer, format_literal(buffer, value) - buffer));
 }
 
-void EvaluationContext::define1f(const std::string &name, const float value)
+void EvaluationContext::define1d(std::string_view name, const double value)
 {
-    std::ostringstream tmp;
-    tmp << std::setprecision(10) << value;
-    define(name, tmp.str());
+    char buffer[max_literal_size];
+    define(name, std::string_view(buffer, format_literal(buffer, value) - buffer));
 }
 
-void EvaluationContext::define1d(const std::string &name, const double value)
+void EvaluationContext::define2f(std::string_view name, const float x, const float y)
 {
-    std::ostringstream tmp;
-    tmp << std::setprecision(18) << value;
-    define(name, tmp.str());
+    const float values[] = {x, y};
+    define_vector(name, "vec2", values, 2);
+}
+
+void EvaluationContext::define3f(std::string_view name, const float x, const float y,
+                                 const float z)
+{
+    const float values[] = {x, y, z};
+    define_vector(name, "vec3", values, 3);
+}
+
+void EvaluationContext::define4f(std::string_view name, const float x, const float y,
+                                 const float z, const float w)
+{
+    const float values[] = {x, y, z, w};
+    define_vector(name, "vec4", values, 4);
+}
+
+void EvaluationContext::define2d(std::string_view name, const double x, const double y)
+{
+    const double values[] = {x, y};
+    define_vector(name, "dvec2", values, 2);
+}
+
+void EvaluationContext::define3d(std::string_view name, const double x, const double y,
+                                 const double z)
+{
+    const double values[] = {x, y, z};
+    define_vector(name, "dvec3", values, 3);
+}
+
+void EvaluationContext::define4d(std::string_view name, const double x, const double y,
+                                 const double z, const double w)
+{
+    const double values[] = {x, y, z, w};
+    define_vector(name, "dvec4", values, 4);
+}
+
+void EvaluationContext::define2i(std::string_view name, const std::int32_t x,
+                                 const std::int32_t y)
+{
+    const std::int32_t values[] = {x, y};
+    define_vector(name, "ivec2", values, 2);
+}
+
+void EvaluationContext::define3i(std::string_view name, const std::int32_t x,
+                                 const std::int32_t y, const std::int32_t z)
+{
+    const std::int32_t values[] = {x, y, z};
+    define_vector(name, "ivec3", values, 3);
+}
+
+void EvaluationContext::define4i(std::string_view name, const std::int32_t x,
+                                 const std::int32_t y, const std::int32_t z,
+                                 const std::int32_t w)
+{
+    const std::int32_t values[] = {x, y, z, w};
+    define_vector(name, "ivec4", values, 4);
+}
+
+void EvaluationContext::define2ui(std::string_view name, const std::uint32_t x,
+                                  const std::uint32_t y)
+{
+    const std::uint32_t values[] = {x, y};
+    define_vector(name, "uvec2", values, 2);
+}
+
+void EvaluationContext::define3ui(std::string_view name, const std::uint32_t x,
+                                  const std::uint32_t y, const std::uint32_t z)
+{
+    const std::uint32_t values[] = {x, y, z};
+    define_vector(name, "uvec3", values, 3);
+}
+
+void EvaluationContext::define4ui(std::string_view name, const std::uint32_t x,
+                                  const std::uint32_t y, const std::uint32_t z,
+                                  const std::uint32_t w)
+{
+    const std::uint32_t values[] = {x, y, z, w};
+    define_vector(name, "uvec4", values, 4);
+}
+
+template <typename T>
+void EvaluationContext::define_vector(std::string_view name,
+                                      std::string_view type,
+                                      const T *values,
+                                      std::size_t count)
+{
+    // type, parentheses and ", " separators plus the components
+    char buffer[8 + 4 * (max_literal_size + 2)];
+    char *curr = buffer;
+    curr = std::copy(type.begin(), type.end(), curr);
+    *curr++ = '(';
+    for (std::size_t i = 0; i < count; ++i) {
+        if (i > 0) {
+            *curr++ = ',';
+            *curr++ = ' ';
+        }
+        curr = format_literal(curr, values[i]);
+    }
+    *curr++ = ')';
+    define(name, std::string_view(buffer, curr - buffer));
 }
 
 }
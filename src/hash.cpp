@@ -0,0 +1,157 @@
+#include "spp/hash.hpp"
+
+#include <cstring>
+
+
+namespace spp {
+
+namespace {
+
+constexpr std::uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+constexpr std::uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr std::uint64_t prime3 = 0x165667B19E3779F9ULL;
+constexpr std::uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+constexpr std::uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+inline std::uint64_t rotl(std::uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline std::uint64_t read64(const unsigned char *p)
+{
+    // XXH64 is defined on little endian words
+    std::uint64_t result = 0;
+    for (int i = 7; i >= 0; --i) {
+        result = (result << 8) | p[i];
+    }
+    return result;
+}
+
+inline std::uint32_t read32(const unsigned char *p)
+{
+    return std::uint32_t(p[0]) | (std::uint32_t(p[1]) << 8) |
+            (std::uint32_t(p[2]) << 16) | (std::uint32_t(p[3]) << 24);
+}
+
+inline std::uint64_t round(std::uint64_t acc, std::uint64_t input)
+{
+    acc += input * prime2;
+    acc = rotl(acc, 31);
+    return acc * prime1;
+}
+
+inline std::uint64_t merge_round(std::uint64_t acc, std::uint64_t value)
+{
+    acc ^= round(0, value);
+    return acc * prime1 + prime4;
+}
+
+std::uint64_t finalize(std::uint64_t hash, const unsigned char *p, std::size_t size)
+{
+    while (size >= 8) {
+        hash ^= round(0, read64(p));
+        hash = rotl(hash, 27) * prime1 + prime4;
+        p += 8;
+        size -= 8;
+    }
+    if (size >= 4) {
+        hash ^= std::uint64_t(read32(p)) * prime1;
+        hash = rotl(hash, 23) * prime2 + prime3;
+        p += 4;
+        size -= 4;
+    }
+    while (size > 0) {
+        hash ^= (*p) * prime5;
+        hash = rotl(hash, 11) * prime1;
+        ++p;
+        --size;
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+}
+
+
+XXH64Stream::XXH64Stream(std::uint64_t seed):
+    m_acc{seed + prime1 + prime2, seed + prime2, seed, seed - prime1},
+    m_seed(seed),
+    m_total_size(0),
+    m_buffered(0)
+{
+
+}
+
+void XXH64Stream::update(const void *data, std::size_t size)
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    m_total_size += size;
+
+    if (m_buffered + size < sizeof(m_buffer)) {
+        std::memcpy(m_buffer + m_buffered, p, size);
+        m_buffered += size;
+        return;
+    }
+
+    if (m_buffered > 0) {
+        const std::size_t fill = sizeof(m_buffer) - m_buffered;
+        std::memcpy(m_buffer + m_buffered, p, fill);
+        for (int i = 0; i < 4; ++i) {
+            m_acc[i] = round(m_acc[i], read64(m_buffer + 8*i));
+        }
+        p += fill;
+        size -= fill;
+        m_buffered = 0;
+    }
+
+    while (size >= 32) {
+        for (int i = 0; i < 4; ++i) {
+            m_acc[i] = round(m_acc[i], read64(p + 8*i));
+        }
+        p += 32;
+        size -= 32;
+    }
+
+    std::memcpy(m_buffer, p, size);
+    m_buffered = size;
+}
+
+void XXH64Stream::update_u64(std::uint64_t value)
+{
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; ++i) {
+        bytes[i] = static_cast<unsigned char>(value >> (8*i));
+    }
+    update(bytes, sizeof(bytes));
+}
+
+std::uint64_t XXH64Stream::digest() const
+{
+    std::uint64_t hash;
+    if (m_total_size >= 32) {
+        hash = rotl(m_acc[0], 1) + rotl(m_acc[1], 7) +
+                rotl(m_acc[2], 12) + rotl(m_acc[3], 18);
+        for (int i = 0; i < 4; ++i) {
+            hash = merge_round(hash, m_acc[i]);
+        }
+    } else {
+        hash = m_seed + prime5;
+    }
+    hash += m_total_size;
+    return finalize(hash, m_buffer, m_buffered);
+}
+
+std::uint64_t xxh64(const void *data, std::size_t size, std::uint64_t seed)
+{
+    XXH64Stream stream(seed);
+    stream.update(data, size);
+    return stream.digest();
+}
+
+}
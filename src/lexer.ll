@@ -9,7 +9,12 @@ typedef spp::Parser::token_type token_type;
 
 #define YY_NO_UNISTD_H
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
 #include "spp/context.hpp"
+#include "spp/scan.hpp"
 
 %}
 
@@ -24,7 +29,7 @@ typedef spp::Parser::token_type token_type;
 
 %{
 #define MAX_INCLUDE_DEPTH 10
-#define YY_USER_ACTION yylloc->columns(yyleng);
+#define YY_USER_ACTION yylloc->columns(yyleng); m_offset += yyleng;
 %}
 
 %%
@@ -44,6 +49,7 @@ typedef spp::Parser::token_type token_type;
     // check the remainder of the program. so we have to make reasonable output
     // here...
     unput(*yytext);
+    --m_offset;
     BEGIN(CODE);
 }
 
@@ -88,20 +94,20 @@ typedef spp::Parser::token_type token_type;
 
 <CODE>\{ {
     yylloc->step();
-    yylval->strlit = new std::string(yytext, yyleng);
+    yylval->sourcecode = token_text();
     return token::SOURCECODE;
 }
 
 <CODE>[^{\n]*\n {
     yylloc->step();
     yylloc->lines(1);
-    yylval->strlit = new std::string(yytext, yyleng);
+    yylval->sourcecode = token_text();
     return token::SOURCECODE;
 }
 
 <CODE>[^{\n]+ {
     yylloc->step();
-    yylval->strlit = new std::string(yytext, yyleng);
+    yylval->sourcecode = token_text();
     return token::SOURCECODE;
 }
 
@@ -110,6 +116,11 @@ typedef spp::Parser::token_type token_type;
     return token::DIRECTIVE_INCLUDE;
 }
 
+<DIRECTIVE>include_once {
+    yylloc->step();
+    return token::DIRECTIVE_INCLUDE_ONCE;
+}
+
 <DIRECTIVE>[_a-zA-Z][_a-zA-Z0-9]* {
     yylloc->step();
     yylval->strlit = new std::string(yytext, yyleng);
@@ -152,7 +163,23 @@ typedef spp::Parser::token_type token_type;
 namespace spp {
 
 Scanner::Scanner(ParserContext &context, std::istream *in, std::ostream *out):
-    sppFlexLexer(in, out)
+    sppFlexLexer(in, out),
+    m_source(nullptr),
+    m_source_size(0),
+    m_read_pos(0),
+    m_read_limit(std::numeric_limits<std::size_t>::max()),
+    m_offset(0)
+{
+
+}
+
+Scanner::Scanner(ParserContext &, const char *data, std::size_t size):
+    sppFlexLexer(nullptr, nullptr),
+    m_source(data),
+    m_source_size(size),
+    m_read_pos(0),
+    m_read_limit(std::numeric_limits<std::size_t>::max()),
+    m_offset(0)
 {
 
 }
@@ -162,11 +189,110 @@ Scanner::~Scanner()
 
 }
 
+int Scanner::LexerInput(char *buf, int max_size)
+{
+    if (!m_source) {
+        return sppFlexLexer::LexerInput(buf, max_size);
+    }
+
+    const std::size_t count = std::min({static_cast<std::size_t>(max_size),
+                                        m_source_size - m_read_pos,
+                                        m_read_limit});
+    std::memcpy(buf, m_source + m_read_pos, count);
+    m_read_pos += count;
+    return count;
+}
+
+TokenText Scanner::token_text() const
+{
+    if (!m_source) {
+        return TokenText{yytext, static_cast<std::size_t>(yyleng)};
+    }
+    // m_offset already includes the current match
+    return TokenText{m_source + m_offset - yyleng,
+                     static_cast<std::size_t>(yyleng)};
+}
+
+bool Scanner::in_code() const
+{
+    return YY_START == CODE;
+}
+
+void Scanner::continue_in_directive(std::size_t offset)
+{
+    if (YY_CURRENT_BUFFER) {
+        yy_flush_buffer(YY_CURRENT_BUFFER);
+    }
+    m_read_pos = offset;
+    m_offset = offset;
+    BEGIN(DIRECTIVE);
+}
+
 void Scanner::set_debug(bool debug)
 {
     yy_flex_debug = debug;
 }
 
+
+SimdScanner::SimdScanner(ParserContext &context, const char *data, std::size_t size):
+    Scanner(context, data, size)
+{
+    // directives are short; don't let flex copy large parts of the source
+    // which we skip anyways
+    m_read_limit = 256;
+}
+
+Parser::token_type SimdScanner::lex(Parser::semantic_type *yylval,
+                                    Parser::location_type *yylloc)
+{
+    if (!in_code()) {
+        return Scanner::lex(yylval, yylloc);
+    }
+
+    yylloc->step();
+
+    const char *const begin = m_source + m_offset;
+    const char *const end = m_source + m_source_size;
+    if (begin == end) {
+        return token::END;
+    }
+
+    if (begin[0] == '{' && begin + 1 < end && begin[1] == '%') {
+        yylloc->columns(2);
+        yylloc->step();
+        continue_in_directive(m_offset + 2);
+        return token::DIROPEN;
+    }
+
+    const CodeScan scan = scan_code(begin, end);
+
+    // the flex rules match a line or a single brace at a time and step()
+    // after each match; the location of the first match is what becomes the
+    // location of the section, so reproduce it
+    const position start = yylloc->end;
+    const char *first_end = begin + 1;
+    if (begin[0] != '{') {
+        first_end = std::find_if(begin, scan.stop, [](char c){ return c == '{' || c == '\n'; });
+        if (first_end != scan.stop && *first_end == '\n') {
+            ++first_end;
+        }
+    }
+    yylloc->columns(first_end - begin);
+    yylloc->step();
+    yylloc->end = start;
+
+    if (scan.newlines > 0) {
+        yylloc->lines(scan.newlines);
+        yylloc->columns(scan.stop - scan.last_newline - 1);
+    } else {
+        yylloc->columns(scan.stop - begin);
+    }
+
+    m_offset += scan.stop - begin;
+    yylval->sourcecode = TokenText{begin, static_cast<std::size_t>(scan.stop - begin)};
+    return token::SOURCECODE;
+}
+
 }
 
 #ifdef yylex
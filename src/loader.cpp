@@ -1,9 +1,25 @@
 #include "spp/loader.hpp"
+#include "spp/hash.hpp"
 
+#include <filesystem>
 #include <fstream>
 
 namespace spp {
 
+namespace {
+
+std::string filesystem_canonical(const std::string &path)
+{
+    std::error_code error;
+    std::filesystem::path result = std::filesystem::weakly_canonical(path, error);
+    if (error) {
+        return path;
+    }
+    return result.generic_string();
+}
+
+}
+
 /* spp::Loader */
 
 Loader::~Loader()
@@ -11,6 +27,35 @@ Loader::~Loader()
 
 }
 
+std::optional<std::uint64_t> Loader::content_hash(const std::string &path)
+{
+    std::unique_ptr<std::istream> in(open(path));
+    if (!in || !*in) {
+        return std::nullopt;
+    }
+
+    XXH64Stream hash;
+    char chunk[16384];
+    while (in->read(chunk, sizeof(chunk)), in->gcount() > 0) {
+        hash.update(chunk, in->gcount());
+    }
+    return hash.digest();
+}
+
+std::shared_ptr<const SourceBuffer> Loader::open_buffer(const std::string &path)
+{
+    std::unique_ptr<std::istream> in(open(path));
+    if (!in) {
+        return nullptr;
+    }
+    return SourceBuffer::from_stream(*in);
+}
+
+std::string Loader::canonical(const std::string &path)
+{
+    return path;
+}
+
 /* spp::DefaultLoader */
 
 std::unique_ptr<std::istream> DefaultLoader::open(const std::string &path)
@@ -18,6 +63,39 @@ std::unique_ptr<std::istream> DefaultLoader::open(const std::string &path)
     return std::make_unique<std::ifstream>(path);
 }
 
+std::string DefaultLoader::canonical(const std::string &path)
+{
+    return filesystem_canonical(path);
+}
+
+/* spp::MmapLoader */
 
+std::unique_ptr<std::istream> MmapLoader::open(const std::string &path)
+{
+    auto in = std::make_unique<std::ifstream>(path, std::ios::binary);
+    if (!*in) {
+        return nullptr;
+    }
+    return in;
+}
+
+std::shared_ptr<const SourceBuffer> MmapLoader::open_buffer(const std::string &path)
+{
+    return SourceBuffer::map_file(path);
+}
+
+std::optional<std::uint64_t> MmapLoader::content_hash(const std::string &path)
+{
+    std::shared_ptr<const SourceBuffer> buffer = open_buffer(path);
+    if (!buffer) {
+        return std::nullopt;
+    }
+    return xxh64(buffer->view());
+}
+
+std::string MmapLoader::canonical(const std::string &path)
+{
+    return filesystem_canonical(path);
+}
 
 }
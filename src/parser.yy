@@ -17,16 +17,13 @@
 %locations
 
 %parse-param { spp::ParserContext &ctx }
-%parse-param { spp::Program &dest }
+%parse-param { spp::SectionSink &dest }
 %error-verbose
 
 %union {
-    std::string *sourcecode;
+    TokenText sourcecode;
     std::string *strlit;
     long int intlit;
-    Program *program;
-    VersionDeclaration *version;
-    IncludeDirective *include;
 }
 
 %token END 0 "end of file"
@@ -40,15 +37,12 @@
 %token DIRCLOSE "end of directive"
 %token ERROR
 %token DIRECTIVE_INCLUDE "include keyword"
+%token DIRECTIVE_INCLUDE_ONCE "include_once keyword"
 
-%type <program> program
-%type <version> version
-%type <include> include
 %type <strlit> STRLIT IDENT ERROR strlit
 %type <intlit> shader_type INTLIT
 
-%destructor { delete $$; } SOURCECODE IDENT
-%destructor { delete $$; } version
+%destructor { delete $$; } IDENT
 
 %{
 
@@ -75,16 +69,19 @@ shader_type
         } else {
             $$ = static_cast<int>(it->second);
         }
+        delete $1;
     }
 
 version
     : VERSION INTLIT IDENT shader_type EOL
     {
-        $$ = new VersionDeclaration(@$, $2, *$3, static_cast<ProgramType>($4));
+        dest.version(@$, $2, *$3, static_cast<ProgramType>($4));
+        delete $3;
     }
     | VERSION INTLIT IDENT EOL
     {
-        $$ = new VersionDeclaration(@$, $2, *$3, ProgramType::GENERIC);
+        dest.version(@$, $2, *$3, ProgramType::GENERIC);
+        delete $3;
     }
 
 strlit
@@ -102,41 +99,29 @@ strlit
 include
     : DIROPEN DIRECTIVE_INCLUDE strlit DIRCLOSE
     {
-        $$ = new IncludeDirective(@$, *$3);
+        dest.include(@$, *$3);
+        delete $3;
+    }
+    | DIROPEN DIRECTIVE_INCLUDE_ONCE strlit DIRCLOSE
+    {
+        dest.include_once(@$, *$3);
         delete $3;
     }
 
 program
     : program SOURCECODE
     {
-        $$ = $1;
-        $$->append_section(std::make_unique<StaticSourceSection>(@2, *$2));
-        delete $2;
+        dest.source(@2, std::string_view($2.data, $2.size));
     }
     | program include
-    {
-        $$ = $1;
-        $$->append_section(std::unique_ptr<IncludeDirective>($2));
-    }
     | program error
-    {
-        $$ = $1;
-    }
     | error
-    {
-        $$ = &dest;
-    }
     | version
-    {
-        $$ = &dest;
-        $$->append_section(std::unique_ptr<VersionDeclaration>($1));
-        $$->set_type($1->type());
-    }
 
 %%
 
 void spp::Parser::error(const spp::Parser::location_type &l,
                         const std::string &m)
 {
-    dest.add_local_error(l, m);
+    dest.error(l, m);
 }
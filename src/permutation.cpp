@@ -0,0 +1,100 @@
+#include "spp/permutation.hpp"
+
+#include <stdexcept>
+
+#include "spp/plan.hpp"
+
+
+namespace spp {
+
+void PermutationMatrix::add_axis(std::string name, std::vector<std::string> values)
+{
+    if (values.empty()) {
+        throw std::invalid_argument("permutation axis " + name + " has no values");
+    }
+    for (const Axis &axis: m_axes) {
+        if (axis.name == name) {
+            throw std::invalid_argument("duplicate permutation axis " + name);
+        }
+    }
+    m_axes.push_back(Axis{std::move(name), std::move(values)});
+}
+
+void PermutationMatrix::exclude(Rule rule)
+{
+    m_exclusions.emplace_back(std::move(rule));
+}
+
+std::string_view PermutationMatrix::value(const Choice &choice, std::string_view axis) const
+{
+    for (std::size_t i = 0; i < m_axes.size(); ++i) {
+        if (m_axes[i].name == axis) {
+            return m_axes[i].values[choice[i]];
+        }
+    }
+    throw std::out_of_range("no permutation axis " + std::string(axis));
+}
+
+std::vector<PermutationMatrix::Choice> PermutationMatrix::permutations() const
+{
+    std::vector<Choice> result;
+    Choice curr(m_axes.size(), 0);
+
+    while (true) {
+        bool excluded = false;
+        for (const Rule &rule: m_exclusions) {
+            if (rule(*this, curr)) {
+                excluded = true;
+                break;
+            }
+        }
+        if (!excluded) {
+            result.push_back(curr);
+        }
+
+        // advance like an odometer, last axis first
+        std::size_t axis = m_axes.size();
+        while (axis > 0) {
+            --axis;
+            if (++curr[axis] < m_axes[axis].values.size()) {
+                break;
+            }
+            curr[axis] = 0;
+            if (axis == 0) {
+                return result;
+            }
+        }
+        if (m_axes.empty()) {
+            return result;
+        }
+    }
+}
+
+
+std::vector<Variant> evaluate_permutations(const Program &program,
+                                           const EvaluationContext &base,
+                                           const PermutationMatrix &matrix,
+                                           ThreadPool &pool)
+{
+    // compile the plan once, before the workers share it
+    const EvaluationPlan &plan = program.plan();
+
+    std::vector<Variant> result;
+    for (auto &choice: matrix.permutations()) {
+        result.push_back(Variant{std::move(choice), std::string()});
+    }
+
+    pool.parallel_for(result.size(), [&](std::size_t i) {
+        Variant &variant = result[i];
+        EvaluationContext ctx(base);
+        for (std::size_t axis = 0; axis < variant.choice.size(); ++axis) {
+            ctx.define(matrix.axes()[axis].name,
+                       matrix.axes()[axis].values[variant.choice[axis]]);
+        }
+        plan.evaluate(ctx, variant.source);
+    });
+
+    return result;
+}
+
+}
@@ -0,0 +1,207 @@
+#include "spp/plan.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include "spp/ast.hpp"
+#include "spp/context.hpp"
+#include "spp/hash.hpp"
+
+
+namespace spp {
+
+namespace {
+
+inline char *write_text(char *dest, std::string_view text)
+{
+    std::memcpy(dest, text.data(), text.size());
+    return dest + text.size();
+}
+
+}
+
+
+Fragments::Fragments():
+    m_fragments(),
+    m_size(0)
+{
+
+}
+
+std::string Fragments::str() const
+{
+    std::string result;
+    result.reserve(m_size);
+    for (std::string_view fragment: m_fragments) {
+        result.append(fragment.data(), fragment.size());
+    }
+    return result;
+}
+
+
+EvaluationPlan::EvaluationPlan(const Program &program):
+    m_static_size(0),
+    m_define_blocks(0),
+    m_content_hash(0)
+{
+    std::unordered_set<std::string_view> expanded_once;
+    compile(program, false, expanded_once);
+    hash_segments();
+}
+
+void EvaluationPlan::hash_segments()
+{
+    XXH64Stream segment;
+    for (const Step &step: m_steps) {
+        if (step.is_define_block) {
+            m_segment_hashes.push_back(segment.digest());
+            segment = XXH64Stream();
+        } else {
+            segment.update(step.text);
+        }
+    }
+    m_segment_hashes.push_back(segment.digest());
+
+    XXH64Stream content;
+    for (std::uint64_t hash: m_segment_hashes) {
+        content.update_u64(hash);
+    }
+    m_content_hash = content.digest();
+}
+
+void EvaluationPlan::append_static(std::string_view text)
+{
+    if (text.empty()) {
+        return;
+    }
+
+    // consecutive steps are not merged even if their text happens to be
+    // adjacent in memory: it may lie in different buffers. Contiguous text
+    // of one buffer is already merged into one section by the parser.
+    m_static_size += text.size();
+    m_steps.push_back(Step{text, false});
+}
+
+void EvaluationPlan::compile(const Program &program,
+                             bool as_include,
+                             std::unordered_set<std::string_view> &expanded_once)
+{
+    for (Program::size_type i = 0; i < program.size(); ++i)
+    {
+        const Section &section = program[i];
+        switch (section.kind()) {
+        case SectionKind::VERSION:
+        {
+            if (as_include) {
+                break;
+            }
+            m_generated.emplace_back(
+                        "#version " + std::to_string(section.version()) + " " +
+                        std::string(section.profile()) + "\n");
+            append_static(m_generated.back());
+            m_steps.push_back(Step{std::string_view(), true});
+            ++m_define_blocks;
+            break;
+        }
+        case SectionKind::STATIC_SOURCE:
+        {
+            append_static(section.source());
+            break;
+        }
+        case SectionKind::INCLUDE:
+        case SectionKind::INCLUDE_ONCE:
+        {
+            throw std::runtime_error("cannot evaluate include directive");
+        }
+        case SectionKind::INCLUDED_PROGRAM:
+        {
+            compile(*section.program(), true, expanded_once);
+            break;
+        }
+        case SectionKind::INCLUDE_GUARD:
+        {
+            if (!expanded_once.insert(section.path()).second) {
+                i += section.guarded();
+            }
+            break;
+        }
+        }
+    }
+}
+
+std::uint64_t EvaluationPlan::fingerprint(const EvaluationContext &ctx) const
+{
+    const std::uint64_t defines_hash = ctx.define_block_hash();
+
+    XXH64Stream result;
+    result.update_u64(m_segment_hashes.front());
+    for (std::size_t i = 1; i < m_segment_hashes.size(); ++i) {
+        result.update_u64(defines_hash);
+        result.update_u64(m_segment_hashes[i]);
+    }
+    return result.digest();
+}
+
+std::size_t EvaluationPlan::size(const EvaluationContext &ctx) const
+{
+    return m_static_size + m_define_blocks * ctx.define_block().size();
+}
+
+void EvaluationPlan::evaluate(const EvaluationContext &ctx, std::string &into) const
+{
+    const std::size_t offset = into.size();
+    into.resize(offset + size(ctx));
+    evaluate(ctx, &into[offset], into.size() - offset);
+}
+
+std::string EvaluationPlan::evaluate(const EvaluationContext &ctx) const
+{
+    std::string result;
+    evaluate(ctx, result);
+    return result;
+}
+
+std::size_t EvaluationPlan::evaluate(const EvaluationContext &ctx,
+                                     char *dest,
+                                     std::size_t capacity) const
+{
+    const std::size_t required = size(ctx);
+    if (capacity < required) {
+        throw std::length_error("output buffer too small for evaluated program");
+    }
+
+    char *curr = dest;
+    for (const Step &step: m_steps) {
+        if (step.is_define_block) {
+            curr = write_text(curr, ctx.define_block());
+        } else {
+            curr = write_text(curr, step.text);
+        }
+    }
+    return curr - dest;
+}
+
+void EvaluationPlan::evaluate(const EvaluationContext &ctx, std::ostream &into) const
+{
+    for (const Step &step: m_steps) {
+        const std::string_view text = step.is_define_block ? ctx.define_block() : step.text;
+        into.write(text.data(), text.size());
+    }
+}
+
+Fragments EvaluationPlan::fragments(const EvaluationContext &ctx) const
+{
+    Fragments result;
+
+    result.m_fragments.reserve(m_steps.size());
+    for (const Step &step: m_steps) {
+        std::string_view text = step.is_define_block ? ctx.define_block() : step.text;
+        if (!text.empty()) {
+            result.m_fragments.push_back(text);
+            result.m_size += text.size();
+        }
+    }
+    return result;
+}
+
+}
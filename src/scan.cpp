@@ -0,0 +1,155 @@
+#include "spp/scan.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SPP_SCAN_AVX2
+#endif
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SPP_SCAN_SSE2
+#endif
+
+namespace spp {
+
+namespace {
+
+CodeScan scan_code_tail(const char *p, const char *end, CodeScan result)
+{
+    for (; p < end; ++p) {
+        if (*p == '{' && p + 1 < end && p[1] == '%') {
+            result.stop = p;
+            return result;
+        }
+        if (*p == '\n') {
+            ++result.newlines;
+            result.last_newline = p;
+        }
+    }
+    result.stop = end;
+    return result;
+}
+
+#if defined(SPP_SCAN_SSE2) || defined(SPP_SCAN_AVX2)
+
+/**
+ * Account for the newlines in a block starting at @a block, given as a bit
+ * mask of their positions.
+ */
+inline void count_newlines(const char *block, unsigned int mask, CodeScan &result)
+{
+    if (mask) {
+        result.newlines += __builtin_popcount(mask);
+        result.last_newline = block + (31 - __builtin_clz(mask));
+    }
+}
+
+/**
+ * Find the first `{` in @a braces which starts a directive.
+ *
+ * @return the index of the `{` in the block, or -1 if there is none.
+ */
+inline int find_directive(const char *block, const char *end, unsigned int braces)
+{
+    while (braces) {
+        const int i = __builtin_ctz(braces);
+        if (block + i + 1 < end && block[i + 1] == '%') {
+            return i;
+        }
+        braces &= braces - 1;
+    }
+    return -1;
+}
+
+#endif
+
+#ifdef SPP_SCAN_SSE2
+
+CodeScan scan_code_sse2(const char *begin, const char *end)
+{
+    CodeScan result{end, 0, nullptr};
+    const __m128i brace = _mm_set1_epi8('{');
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    const char *p = begin;
+    while (end - p >= 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const unsigned int braces = _mm_movemask_epi8(_mm_cmpeq_epi8(block, brace));
+        const unsigned int newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+
+        const int directive = find_directive(p, end, braces);
+        if (directive >= 0) {
+            count_newlines(p, newlines & ((1u << directive) - 1), result);
+            result.stop = p + directive;
+            return result;
+        }
+        count_newlines(p, newlines, result);
+        p += 16;
+    }
+
+    return scan_code_tail(p, end, result);
+}
+
+#endif
+
+#ifdef SPP_SCAN_AVX2
+
+__attribute__((target("avx2")))
+CodeScan scan_code_avx2(const char *begin, const char *end)
+{
+    CodeScan result{end, 0, nullptr};
+    const __m256i brace = _mm256_set1_epi8('{');
+    const __m256i newline = _mm256_set1_epi8('\n');
+
+    const char *p = begin;
+    while (end - p >= 32) {
+        const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        const unsigned int braces = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, brace));
+        const unsigned int newlines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+
+        const int directive = find_directive(p, end, braces);
+        if (directive >= 0) {
+            // directive < 32, so the shift is well-defined
+            count_newlines(p, newlines & ((1ull << directive) - 1), result);
+            result.stop = p + directive;
+            return result;
+        }
+        count_newlines(p, newlines, result);
+        p += 32;
+    }
+
+    return scan_code_tail(p, end, result);
+}
+
+#endif
+
+CodeScan scan_code_scalar(const char *begin, const char *end)
+{
+    return scan_code_tail(begin, end, CodeScan{end, 0, nullptr});
+}
+
+}
+
+std::vector<CodeScanImpl> supported_code_scans()
+{
+    std::vector<CodeScanImpl> result;
+#ifdef SPP_SCAN_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        result.push_back(CodeScanImpl{"avx2", &scan_code_avx2});
+    }
+#endif
+#ifdef SPP_SCAN_SSE2
+    result.push_back(CodeScanImpl{"sse2", &scan_code_sse2});
+#endif
+    result.push_back(CodeScanImpl{"scalar", &scan_code_scalar});
+    return result;
+}
+
+CodeScan scan_code(const char *begin, const char *end)
+{
+    static const auto impl = supported_code_scans().front().scan;
+    return impl(begin, end);
+}
+
+}
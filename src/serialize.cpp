@@ -0,0 +1,277 @@
+#include "spp/serialize.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+namespace spp {
+
+namespace {
+
+constexpr char format_magic[4] = {'S', 'P', 'P', 'C'};
+// bump whenever the layout changes
+constexpr std::uint32_t format_version = 1;
+constexpr std::uint32_t byte_order_mark = 0x01020304;
+
+class Writer
+{
+public:
+    explicit Writer(std::string &dest):
+        m_dest(dest)
+    {
+
+    }
+
+private:
+    std::string &m_dest;
+
+public:
+    template <typename T>
+    void write(T value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values can be written");
+        m_dest.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void write_string(std::string_view text)
+    {
+        write<std::uint32_t>(text.size());
+        m_dest.append(text.data(), text.size());
+    }
+
+    void write_location(const location &loc)
+    {
+        write<std::uint32_t>(loc.begin.line);
+        write<std::uint32_t>(loc.begin.column);
+        write<std::uint32_t>(loc.end.line);
+        write<std::uint32_t>(loc.end.column);
+    }
+
+};
+
+class Reader
+{
+public:
+    Reader(const SourceBuffer &buffer, std::size_t offset):
+        m_begin(buffer.data()),
+        m_pos(buffer.data() + offset),
+        m_end(buffer.data() + buffer.size())
+    {
+
+    }
+
+private:
+    const char *m_begin;
+    const char *m_pos;
+    const char *m_end;
+
+private:
+    const char *take(std::size_t size)
+    {
+        if (static_cast<std::size_t>(m_end - m_pos) < size) {
+            throw std::runtime_error("truncated serialized program");
+        }
+        const char *result = m_pos;
+        m_pos += size;
+        return result;
+    }
+
+public:
+    inline std::size_t offset() const
+    {
+        return m_pos - m_begin;
+    }
+
+    template <typename T>
+    T read()
+    {
+        T value;
+        std::memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    std::string_view read_string()
+    {
+        const std::uint32_t size = read<std::uint32_t>();
+        return std::string_view(take(size), size);
+    }
+
+    location read_location()
+    {
+        location loc;
+        loc.begin.line = read<std::uint32_t>();
+        loc.begin.column = read<std::uint32_t>();
+        loc.end.line = read<std::uint32_t>();
+        loc.end.column = read<std::uint32_t>();
+        return loc;
+    }
+
+};
+
+}
+
+std::string serialize_program(const Program &program,
+                              const ProgramManifest &manifest)
+{
+    std::string result;
+    Writer out(result);
+
+    result.append(format_magic, sizeof(format_magic));
+    out.write(format_version);
+    out.write(byte_order_mark);
+
+    out.write(manifest.settings);
+    out.write<std::uint32_t>(manifest.dependencies.size());
+    for (auto &dependency: manifest.dependencies) {
+        out.write_string(dependency.path);
+        out.write<std::uint8_t>(dependency.present);
+        out.write(dependency.content_hash);
+    }
+    out.write<std::uint32_t>(manifest.includes.size());
+    for (auto &include: manifest.includes) {
+        out.write(include.first);
+        out.write(include.second);
+    }
+
+    out.write_string(program.source_path());
+    out.write<std::uint8_t>(static_cast<std::uint8_t>(program.type()));
+    out.write<std::uint32_t>(program.errors().size());
+    for (auto &error: program.errors()) {
+        out.write_string(std::get<0>(error));
+        out.write_location(std::get<1>(error));
+        out.write_string(std::get<2>(error));
+    }
+
+    out.write<std::uint32_t>(program.size());
+    for (auto iter = program.cbegin(); iter != program.cend(); ++iter) {
+        out.write<std::uint8_t>(static_cast<std::uint8_t>(iter->kind()));
+        out.write_location(iter->loc());
+        out.write<std::uint32_t>(iter->version());
+        out.write<std::uint8_t>(static_cast<std::uint8_t>(iter->type()));
+        out.write_string(iter->text());
+    }
+
+    return result;
+}
+
+SerializedProgram::SerializedProgram(std::shared_ptr<const SourceBuffer> buffer):
+    m_buffer(std::move(buffer)),
+    m_manifest(),
+    m_program_offset(0)
+{
+    Reader in(*m_buffer, 0);
+    const std::uint32_t magic = in.read<std::uint32_t>();
+    if (std::memcmp(&magic, format_magic, sizeof(format_magic)) != 0) {
+        throw std::runtime_error("not a serialized program");
+    }
+    if (in.read<std::uint32_t>() != format_version ||
+            in.read<std::uint32_t>() != byte_order_mark)
+    {
+        throw std::runtime_error("unsupported serialized program format");
+    }
+
+    m_manifest.settings = in.read<std::uint64_t>();
+    const std::uint32_t dependency_count = in.read<std::uint32_t>();
+    for (std::uint32_t i = 0; i < dependency_count; ++i) {
+        ProgramDependency dependency;
+        dependency.path = in.read_string();
+        dependency.present = in.read<std::uint8_t>() != 0;
+        dependency.content_hash = in.read<std::uint64_t>();
+        m_manifest.dependencies.emplace_back(std::move(dependency));
+    }
+    const std::uint32_t include_count = in.read<std::uint32_t>();
+    for (std::uint32_t i = 0; i < include_count; ++i) {
+        const std::uint32_t includer = in.read<std::uint32_t>();
+        const std::uint32_t included = in.read<std::uint32_t>();
+        if (includer >= dependency_count || included >= dependency_count) {
+            throw std::runtime_error("invalid include in serialized program");
+        }
+        m_manifest.includes.emplace_back(includer, included);
+    }
+
+    m_program_offset = in.offset();
+}
+
+std::unique_ptr<Program> SerializedProgram::deserialize(const IncludeResolver &resolve,
+                                                        std::shared_ptr<Arena> arena) const
+{
+    Reader in(*m_buffer, m_program_offset);
+
+    auto program = std::make_unique<Program>(std::string(in.read_string()),
+                                             std::move(arena));
+    program->own_buffer(m_buffer);
+    program->set_type(static_cast<ProgramType>(in.read<std::uint8_t>()));
+
+    const std::uint32_t error_count = in.read<std::uint32_t>();
+    for (std::uint32_t i = 0; i < error_count; ++i) {
+        std::string path(in.read_string());
+        location loc = in.read_location();
+        std::string msg(in.read_string());
+        program->add_error(Program::RecordedError(std::move(path), loc, std::move(msg)));
+    }
+
+    const std::uint32_t section_count = in.read<std::uint32_t>();
+    std::vector<Section> sections;
+    sections.reserve(section_count);
+    for (std::uint32_t i = 0; i < section_count; ++i) {
+        const auto kind = static_cast<SectionKind>(in.read<std::uint8_t>());
+        const location loc = in.read_location();
+        const std::uint32_t version = in.read<std::uint32_t>();
+        const auto type = static_cast<ProgramType>(in.read<std::uint8_t>());
+        const std::string_view text = in.read_string();
+
+        switch (kind) {
+        case SectionKind::VERSION:
+        {
+            sections.emplace_back(Section::version_declaration(loc, version, text, type));
+            break;
+        }
+        case SectionKind::STATIC_SOURCE:
+        {
+            sections.emplace_back(Section::static_source(loc, text));
+            break;
+        }
+        case SectionKind::INCLUDE:
+        {
+            sections.emplace_back(Section::include_directive(loc, text));
+            break;
+        }
+        case SectionKind::INCLUDE_ONCE:
+        {
+            sections.emplace_back(Section::include_once_directive(loc, text));
+            break;
+        }
+        case SectionKind::INCLUDE_GUARD:
+        {
+            // the number of guarded sections is stored as the version
+            sections.emplace_back(Section::include_guard(loc, text, version));
+            break;
+        }
+        case SectionKind::INCLUDED_PROGRAM:
+        {
+            std::shared_ptr<const Program> included = resolve(std::string(text));
+            if (!included) {
+                throw std::runtime_error("failed to resolve included program: " +
+                                         std::string(text));
+            }
+            program->retain(included);
+            sections.emplace_back(Section::included_program(loc, text, included.get()));
+            break;
+        }
+        default:
+            throw std::runtime_error("invalid section kind in serialized program");
+        }
+    }
+    for (std::size_t i = 0; i < sections.size(); ++i) {
+        if (sections[i].kind() == SectionKind::INCLUDE_GUARD &&
+                sections[i].guarded() >= sections.size() - i)
+        {
+            throw std::runtime_error("invalid include guard in serialized program");
+        }
+    }
+    program->assign(std::move(sections));
+
+    return program;
+}
+
+}
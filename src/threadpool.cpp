@@ -0,0 +1,181 @@
+#include "spp/threadpool.hpp"
+
+#include <exception>
+
+
+namespace spp {
+
+namespace {
+
+thread_local const ThreadPool *current_pool = nullptr;
+thread_local std::size_t current_queue = 0;
+
+}
+
+
+ThreadPool::ThreadPool(unsigned int threads):
+    m_pending(0),
+    m_next_queue(0),
+    m_stopping(false)
+{
+    // one queue per worker plus one shared by all other threads
+    for (unsigned int i = 0; i <= threads; ++i) {
+        m_queues.emplace_back(std::make_unique<Queue>());
+    }
+    for (unsigned int i = 0; i < threads; ++i) {
+        m_workers.emplace_back(&ThreadPool::worker_main, this, i+1);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    while (run_pending_task()) {
+        // run whatever is left over if there are no workers
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_wakeup_mutex);
+        m_stopping = true;
+    }
+    m_wakeup.notify_all();
+    for (auto &worker: m_workers) {
+        worker.join();
+    }
+}
+
+bool ThreadPool::pop_task(std::size_t own_queue, Task &task)
+{
+    {
+        Queue &queue = *m_queues[own_queue];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            --m_pending;
+            return true;
+        }
+    }
+
+    for (std::size_t i = 1; i < m_queues.size(); ++i) {
+        Queue &queue = *m_queues[(own_queue + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            --m_pending;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::worker_main(std::size_t index)
+{
+    current_pool = this;
+    current_queue = index;
+
+    Task task;
+    while (true) {
+        if (pop_task(index, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_wakeup_mutex);
+        m_wakeup.wait(lock, [this](){ return m_stopping || m_pending > 0; });
+        if (m_stopping && m_pending == 0) {
+            return;
+        }
+    }
+}
+
+void ThreadPool::submit(Task &&task)
+{
+    std::size_t index = 0;
+    if (current_pool == this) {
+        index = current_queue;
+    } else if (!m_workers.empty()) {
+        index = 1 + m_next_queue++ % m_workers.size();
+    }
+
+    {
+        Queue &queue = *m_queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.emplace_back(std::move(task));
+        ++m_pending;
+    }
+
+    {
+        // synchronise with workers about to wait
+        std::lock_guard<std::mutex> lock(m_wakeup_mutex);
+    }
+    m_wakeup.notify_one();
+}
+
+bool ThreadPool::run_pending_task()
+{
+    Task task;
+    if (!pop_task(current_pool == this ? current_queue : 0, task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::parallel_for(std::size_t count,
+                              const std::function<void(std::size_t)> &func)
+{
+    struct Batch
+    {
+        std::mutex mutex;
+        std::condition_variable done;
+        std::size_t remaining;
+        std::exception_ptr error;
+    };
+
+    auto batch = std::make_shared<Batch>();
+    batch->remaining = count;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        submit([batch, &func, i]() {
+            std::exception_ptr error;
+            try {
+                func(i);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(batch->mutex);
+            if (error && !batch->error) {
+                batch->error = error;
+            }
+            if (--batch->remaining == 0) {
+                batch->done.notify_all();
+            }
+        });
+    }
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(batch->mutex);
+            if (batch->remaining == 0) {
+                break;
+            }
+        }
+        if (run_pending_task()) {
+            continue;
+        }
+        // the remaining tasks are running on other threads
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->done.wait(lock, [&batch](){ return batch->remaining == 0; });
+        break;
+    }
+
+    if (batch->error) {
+        std::rethrow_exception(batch->error);
+    }
+}
+
+}
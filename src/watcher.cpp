@@ -0,0 +1,117 @@
+#include "spp/watcher.hpp"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <system_error>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "spp/context.hpp"
+
+namespace spp {
+
+namespace {
+
+constexpr std::uint32_t watch_mask =
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM;
+
+}
+
+LibraryWatcher::LibraryWatcher(Library &library):
+    m_library(library),
+    m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+{
+    if (m_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "inotify_init1");
+    }
+}
+
+LibraryWatcher::~LibraryWatcher()
+{
+    close(m_fd);
+}
+
+void LibraryWatcher::watch(const std::string &path)
+{
+    const std::filesystem::path file(path);
+    std::string directory = file.parent_path().string();
+    if (directory.empty()) {
+        directory = ".";
+    }
+
+    auto iter = m_directories.find(directory);
+    if (iter == m_directories.end()) {
+        const int wd = inotify_add_watch(m_fd, directory.c_str(), watch_mask);
+        if (wd < 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "inotify_add_watch: " + directory);
+        }
+        iter = m_directories.emplace(directory, wd).first;
+    }
+
+    std::vector<std::string> &paths = m_files[iter->second][file.filename().string()];
+    if (std::find(paths.begin(), paths.end(), path) == paths.end()) {
+        paths.push_back(path);
+    }
+}
+
+std::vector<std::shared_ptr<const Program> > LibraryWatcher::poll(int timeout_ms)
+{
+    pollfd fd{m_fd, POLLIN, 0};
+    if (::poll(&fd, 1, timeout_ms) <= 0) {
+        return {};
+    }
+
+    // collect all pending events first, so that a file which changed in
+    // several steps is only reloaded once
+    std::vector<std::string> changed;
+    alignas(inotify_event) char buffer[4096];
+    for (;;) {
+        const ssize_t length = read(m_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            break;
+        }
+
+        for (ssize_t offset = 0; offset < length; ) {
+            const auto *event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            offset += sizeof(inotify_event) + event->len;
+            if (event->len == 0) {
+                continue;
+            }
+
+            auto directory = m_files.find(event->wd);
+            if (directory == m_files.end()) {
+                continue;
+            }
+            auto paths = directory->second.find(event->name);
+            if (paths == directory->second.end()) {
+                continue;
+            }
+            for (auto &path: paths->second) {
+                if (std::find(changed.begin(), changed.end(), path) == changed.end()) {
+                    changed.push_back(path);
+                }
+            }
+        }
+    }
+
+    std::vector<std::shared_ptr<const Program> > reloaded;
+    for (auto &path: changed) {
+        for (auto &program: m_library.invalidate(path)) {
+            if (std::find(reloaded.begin(), reloaded.end(), program) == reloaded.end()) {
+                reloaded.push_back(std::move(program));
+            }
+        }
+    }
+    return reloaded;
+}
+
+}
+
+#endif
@@ -0,0 +1,41 @@
+#include <catch.hpp>
+
+#include <cstdint>
+
+#include "spp/arena.hpp"
+
+
+using namespace spp;
+
+TEST_CASE("arena/alignment")
+{
+    Arena arena(64);
+
+    arena.allocate(1, 1);
+    void *aligned = arena.allocate(8, 8);
+    CHECK(reinterpret_cast<std::uintptr_t>(aligned) % 8 == 0);
+    CHECK(arena.bytes_used() == 16);
+    CHECK(arena.bytes_reserved() == 64);
+}
+
+TEST_CASE("arena/oversized_allocation")
+{
+    Arena arena(64);
+
+    arena.allocate(16);
+    arena.allocate(256);
+    CHECK(arena.bytes_used() == 272);
+    CHECK(arena.bytes_reserved() == 64 + 256);
+}
+
+TEST_CASE("arena/intern")
+{
+    Arena arena(16);
+
+    std::string text("some text which is longer than a block");
+    std::string_view interned = arena.intern(text);
+    CHECK(interned == text);
+    CHECK(interned.data() != text.data());
+
+    CHECK(arena.intern("").empty());
+}
@@ -1,5 +1,8 @@
 #include <catch.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
 #include <unordered_map>
 
 #include "spp/spp.hpp"
@@ -42,16 +45,216 @@ TEST_CASE("Library/resolve_include_on_load")
     const Program *prog = lib.load("one.glsl");
     REQUIRE(prog);
     CHECK(prog->errors().empty());
-    REQUIRE(prog->size() >= 3);
+    REQUIRE(prog->size() >= 2);
+    CHECK(prog->size() == 2);
+
+    const Section *source = &(*prog)[1];
+    REQUIRE(source->kind() == SectionKind::STATIC_SOURCE);
+    CHECK(source->source() == "foo\nbar\n");
+}
+
+TEST_CASE("Library/resolve_adjacent_includes")
+{
+    auto ddl = std::make_unique<DummyDataLoader>();
+    ddl->add_source("a.glsl", "#version 330 core\n"
+                              "a\n");
+    ddl->add_source("b.glsl", "#version 330 core\n"
+                              "b\n");
+    ddl->add_source("one.glsl", "#version 330 core\n"
+                                "{% include \"a.glsl\" %}"
+                                "{% include \"b.glsl\" %}"
+                                "{% include \"a.glsl\" %}");
+    Library lib(std::move(ddl));
+
+    const Program *prog = lib.load("one.glsl");
+    REQUIRE(prog);
+    CHECK(prog->errors().empty());
+    REQUIRE(prog->size() == 4);
+
+    for (Program::size_type i = 1; i < prog->size(); ++i) {
+        CHECK((*prog)[i].kind() == SectionKind::STATIC_SOURCE);
+    }
+    CHECK((*prog)[1].source() == "a\n");
+    CHECK((*prog)[2].source() == "b\n");
+    CHECK((*prog)[3].source() == "a\n");
+}
+
+TEST_CASE("Library/included_text_is_shared")
+{
+    auto ddl = std::make_unique<DummyDataLoader>();
+    ddl->add_source("common.glsl", "#version 330 core\n"
+                                   "common\n");
+    ddl->add_source("a.glsl", "#version 330 core\n"
+                              "{% include \"common.glsl\" %}");
+    ddl->add_source("b.glsl", "#version 330 core\n"
+                              "{% include \"common.glsl\" %}");
+    Library lib(std::move(ddl));
+
+    const Program *common = lib.load("common.glsl");
+    const Program *a = lib.load("a.glsl");
+    const Program *b = lib.load("b.glsl");
+    REQUIRE(common);
+    REQUIRE(a);
+    REQUIRE(b);
+    REQUIRE(a->size() == 2);
+    REQUIRE(b->size() == 2);
+
+    CHECK((*a)[1].source() == "common\n");
+    CHECK((*a)[1].source().data() == (*common)[1].source().data());
+    CHECK((*b)[1].source().data() == (*common)[1].source().data());
+
+    std::unique_ptr<Program> copy = a->copy();
+    REQUIRE(copy->size() == 2);
+    CHECK((*copy)[0].profile().data() == (*a)[0].profile().data());
+    CHECK((*copy)[1].source().data() == (*common)[1].source().data());
+}
+
+static void add_nested_includes(DummyDataLoader &ddl)
+{
+    ddl.add_source("common.glsl", "#version 330 core\n"
+                                  "common\n");
+    ddl.add_source("lighting.glsl", "#version 330 core\n"
+                                    "light {\n"
+                                    "{% include \"common.glsl\" %}"
+                                    "}\n");
+    ddl.add_source("one.glsl", "#version 330 core\n"
+                               "{% include \"lighting.glsl\" %}\n"
+                               "main\n"
+                               "{% include \"common.glsl\" %}");
+}
+
+TEST_CASE("Library/lazy_includes")
+{
+    auto eager_ddl = std::make_unique<DummyDataLoader>();
+    add_nested_includes(*eager_ddl);
+    Library eager_lib(std::move(eager_ddl));
+
+    auto lazy_ddl = std::make_unique<DummyDataLoader>();
+    add_nested_includes(*lazy_ddl);
+    Library lazy_lib(std::move(lazy_ddl));
+    lazy_lib.set_lazy_includes(true);
+
+    const Program *eager = eager_lib.load("one.glsl");
+    const Program *lazy = lazy_lib.load("one.glsl");
+    REQUIRE(eager);
+    REQUIRE(lazy);
+    CHECK(lazy->errors().empty());
+
+    REQUIRE(lazy->size() == 4);
+    CHECK(lazy->size() < eager->size());
+    CHECK((*lazy)[1].kind() == SectionKind::INCLUDED_PROGRAM);
+    CHECK((*lazy)[1].path() == "lighting.glsl");
+    REQUIRE((*lazy)[1].program());
+    CHECK((*lazy)[1].program()->source_path() == "lighting.glsl");
+    CHECK((*lazy)[3].kind() == SectionKind::INCLUDED_PROGRAM);
+
+    EvaluationContext eager_ctx(eager_lib);
+    eager_ctx.define("FOO", "1");
+    EvaluationContext lazy_ctx(lazy_lib);
+    lazy_ctx.define("FOO", "1");
+
+    std::ostringstream eager_out, lazy_out;
+    eager->evaluate(eager_out, eager_ctx);
+    lazy->evaluate(lazy_out, lazy_ctx);
+    CHECK(lazy_out.str() == eager_out.str());
+    CHECK(lazy_out.str() == "#version 330 core\n"
+                            "#define FOO 1\n"
+                            "light {\n"
+                            "common\n"
+                            "}\n"
+                            "\n"
+                            "main\n"
+                            "common\n");
+}
+
+static void add_diamond_includes(DummyDataLoader &ddl)
+{
+    ddl.add_source("common.glsl", "#version 330 core\n"
+                                  "common\n");
+    ddl.add_source("lighting.glsl", "#version 330 core\n"
+                                    "{% include_once \"common.glsl\" %}"
+                                    "lighting\n");
+    ddl.add_source("shadows.glsl", "#version 330 core\n"
+                                   "{% include_once \"common.glsl\" %}"
+                                   "shadows\n");
+    ddl.add_source("material.glsl", "#version 330 core\n"
+                                    "{% include_once \"lighting.glsl\" %}"
+                                    "{% include_once \"shadows.glsl\" %}"
+                                    "{% include_once \"lighting.glsl\" %}"
+                                    "{% include \"common.glsl\" %}"
+                                    "material\n");
+}
+
+TEST_CASE("Library/include_once")
+{
+    for (bool lazy: {false, true}) {
+        auto ddl = std::make_unique<DummyDataLoader>();
+        add_diamond_includes(*ddl);
+        Library lib(std::move(ddl));
+        lib.set_lazy_includes(lazy);
+
+        const Program *prog = lib.load("material.glsl");
+        REQUIRE(prog);
+        CHECK(prog->errors().empty());
+
+        // common is expanded once through include_once, and once more by the
+        // plain include
+        CHECK(prog->plan().evaluate(EvaluationContext(lib)) ==
+              "#version 330 core\n"
+              "common\n"
+              "lighting\n"
+              "shadows\n"
+              "common\n"
+              "material\n");
+
+        if (!lazy) {
+            // the repeated files are left out of the resolved program
+            unsigned int common_sources = 0;
+            for (auto iter = prog->cbegin(); iter != prog->cend(); ++iter) {
+                if (iter->kind() == SectionKind::STATIC_SOURCE &&
+                        iter->source() == "common\n")
+                {
+                    ++common_sources;
+                }
+            }
+            CHECK(common_sources == 2);
+        }
+    }
+}
+
+TEST_CASE("Library/resolve_include_on_load_with_arena")
+{
+    auto ddl = std::make_unique<DummyDataLoader>();
+    ddl->add_source("other.glsl", "#version 330 core\n"
+                                  "{% include \"third.glsl\" %}\n"
+                                  "bar\n");
+    ddl->add_source("third.glsl", "#version 330 core\n"
+                                  "foo\n");
+    ddl->add_source("one.glsl", "#version 330 core\n"
+                                "{% include \"other.glsl\" %}");
+    Library lib(std::move(ddl));
+    lib.set_arena_block_size(256);
+
+    const Program *prog = lib.load("one.glsl");
+    REQUIRE(prog);
+    CHECK(prog->errors().empty());
+    REQUIRE(prog->arena());
+    CHECK(prog->arena()->bytes_used() > 0);
     CHECK(prog->size() == 3);
 
-    const StaticSourceSection *source(dynamic_cast<const StaticSourceSection*>(&(*prog)[1]));
-    REQUIRE(source);
-    CHECK(source->source() == "foo\n");
+    EvaluationContext ctx(lib);
+    std::ostringstream out;
+    prog->evaluate(out, ctx);
+    CHECK(out.str() == "#version 330 core\nfoo\n\nbar\n");
 
-    source = dynamic_cast<const StaticSourceSection*>(&(*prog)[2]);
-    REQUIRE(source);
-    CHECK(source->source() == "bar\n");
+    // the copy interns nothing and shares the arena instead of owning one
+    std::unique_ptr<Program> copy = prog->copy();
+    CHECK(!copy->arena());
+    CHECK(std::any_of(copy->retained().begin(), copy->retained().end(),
+                      [prog](const std::shared_ptr<const void> &storage) {
+                          return storage.get() == prog->arena();
+                      }));
+    CHECK(copy->size() == 3);
 }
 
 TEST_CASE("Library/recursive_include_removes_include_and_adds_error")
@@ -87,6 +290,42 @@ TEST_CASE("EvaluationContext/reject_duplicate_defines")
     CHECK_THROWS_AS(ctx.define("FOO", "FNORD"), std::invalid_argument);
 }
 
+TEST_CASE("EvaluationContext/define_block")
+{
+    Library lib;
+    EvaluationContext ctx(lib);
+
+    CHECK(ctx.define_block().empty());
+
+    ctx.define("FOO", "BAR");
+    ctx.define("BAZ", "");
+    CHECK(ctx.define_block() == "#define FOO BAR\n"
+                                "#define BAZ \n");
+    CHECK(ctx.define_count() == 2);
+
+    auto defines = ctx.defines();
+    REQUIRE(defines.size() == 2);
+    CHECK(std::get<0>(defines[0]) == "FOO");
+    CHECK(std::get<1>(defines[0]) == "BAR");
+    CHECK(std::get<0>(defines[1]) == "BAZ");
+    CHECK(std::get<1>(defines[1]) == "");
+
+    CHECK_THROWS_AS(ctx.define("BAZ", "1"), std::invalid_argument);
+    CHECK(ctx.define_count() == 2);
+
+    // a name which is a prefix of an existing one is not a duplicate
+    ctx.define("BA", "1");
+    CHECK(ctx.define_count() == 3);
+
+    // duplicates are still found after the defines were moved around
+    for (int i = 0; i < 1000; ++i) {
+        ctx.define("D" + std::to_string(i), "1");
+    }
+    CHECK_THROWS_AS(ctx.define("D0", "2"), std::invalid_argument);
+    CHECK_THROWS_AS(ctx.define("FOO", "2"), std::invalid_argument);
+    CHECK(ctx.define_count() == 1003);
+}
+
 TEST_CASE("EvaluationContext/inject_defines")
 {
     auto ddl = std::make_unique<DummyDataLoader>();
@@ -111,8 +350,292 @@ TEST_CASE("EvaluationContext/inject_defines")
     std::string expected("#version 330 core\n"
                          "#define FOO BAR\n"
                          "#define BAZI 123\n"
-                         "#define BAZD 1.00000000000000004e-10\n"
+                         "#define BAZD 1e-10lf\n"
                          "foo\n");
 
     CHECK(out.str() == expected);
 }
+
+TEST_CASE("EvaluationPlan/exact_size")
+{
+    auto ddl = std::make_unique<DummyDataLoader>();
+    add_nested_includes(*ddl);
+    Library lib(std::move(ddl));
+
+    const Program *prog = lib.load("one.glsl");
+    REQUIRE(prog);
+    CHECK(prog->errors().empty());
+
+    EvaluationContext ctx(lib);
+    ctx.define("FOO", "BAR");
+    ctx.define1ull("BAZ", 123);
+
+    const EvaluationPlan &plan = prog->plan();
+    CHECK(&plan == &prog->plan());
+
+    std::ostringstream out;
+    prog->evaluate(out, ctx);
+
+    const std::string evaluated = plan.evaluate(ctx);
+    CHECK(evaluated == out.str());
+    CHECK(plan.size(ctx) == evaluated.size());
+    CHECK(plan.static_size() == evaluated.size() - std::string("#define FOO BAR\n#define BAZ 123\n").size());
+
+    std::string appended("prefix");
+    plan.evaluate(ctx, appended);
+    CHECK(appended == "prefix" + evaluated);
+
+    std::vector<char> buffer(plan.size(ctx));
+    CHECK(plan.evaluate(ctx, buffer.data(), buffer.size()) == buffer.size());
+    CHECK(std::string(buffer.data(), buffer.size()) == evaluated);
+
+    CHECK_THROWS_AS(plan.evaluate(ctx, buffer.data(), buffer.size() - 1),
+                    std::length_error);
+}
+
+TEST_CASE("EvaluationPlan/lazy_includes")
+{
+    auto eager_ddl = std::make_unique<DummyDataLoader>();
+    add_nested_includes(*eager_ddl);
+    Library eager_lib(std::move(eager_ddl));
+
+    auto lazy_ddl = std::make_unique<DummyDataLoader>();
+    add_nested_includes(*lazy_ddl);
+    Library lazy_lib(std::move(lazy_ddl));
+    lazy_lib.set_lazy_includes(true);
+
+    const Program *eager = eager_lib.load("one.glsl");
+    const Program *lazy = lazy_lib.load("one.glsl");
+    REQUIRE(eager);
+    REQUIRE(lazy);
+
+    EvaluationContext ctx(eager_lib);
+    ctx.define("FOO", "1");
+
+    CHECK(lazy->plan().evaluate(ctx) == eager->plan().evaluate(ctx));
+    CHECK(lazy->plan().size(ctx) == eager->plan().size(ctx));
+}
+
+TEST_CASE("EvaluationPlan/recompiled_after_modification")
+{
+    std::istringstream data("#version 330 core\n"
+                            "foo\n");
+    ParserContext pctx(data);
+    std::unique_ptr<Program> prog = pctx.parse();
+    REQUIRE(prog);
+
+    Library lib;
+    EvaluationContext ctx(lib);
+    CHECK(prog->plan().evaluate(ctx) == "#version 330 core\nfoo\n");
+
+    prog->erase(prog->begin() + 1);
+    CHECK(prog->plan().evaluate(ctx) == "#version 330 core\n");
+
+    // replace a section after it was evaluated
+    const std::string bar("bar\n");
+    prog->insert(prog->end(), Section::static_source(location(), "baz\n"));
+    CHECK(prog->plan().evaluate(ctx) == "#version 330 core\nbaz\n");
+    prog->erase(prog->begin() + 1);
+    prog->insert(prog->end(), Section::static_source(location(), bar));
+    CHECK(prog->plan().evaluate(ctx) == "#version 330 core\nbar\n");
+
+    std::vector<Section> sections(prog->begin(), prog->end());
+    std::swap(sections[0], sections[1]);
+    prog->assign(std::move(sections));
+    CHECK(prog->plan().evaluate(ctx) == "bar\n#version 330 core\n");
+
+    // sections cannot be changed in place, which would bypass the plan
+    static_assert(std::is_const<std::remove_reference_t<decltype((*prog)[0])> >::value,
+                  "sections must be read-only");
+    static_assert(std::is_const<std::remove_reference_t<decltype(*prog->begin())> >::value,
+                  "sections must be read-only");
+}
+
+TEST_CASE("EvaluationPlan/fragments")
+{
+    auto ddl = std::make_unique<DummyDataLoader>();
+    add_nested_includes(*ddl);
+    Library lib(std::move(ddl));
+    lib.set_lazy_includes(true);
+
+    const Program *prog = lib.load("one.glsl");
+    const Program *common = lib.load("common.glsl");
+    REQUIRE(prog);
+    REQUIRE(common);
+
+    EvaluationContext ctx(lib);
+    ctx.define("FOO", "BAR");
+
+    Fragments fragments = prog->evaluate(ctx);
+    CHECK(fragments.str() == prog->plan().evaluate(ctx));
+    CHECK(fragments.size() == prog->plan().size(ctx));
+
+    // version, define block, "light {\n", common, "}\n", "\nmain\n", common
+    REQUIRE(fragments.count() == 7);
+    CHECK(fragments.fragments()[1] == "#define FOO BAR\n");
+    CHECK(fragments.fragments()[3].data() == (*common)[1].source().data());
+    CHECK(fragments.fragments()[6].data() == (*common)[1].source().data());
+
+    // the fragments do not refer to the Fragments object itself
+    Fragments moved(std::move(fragments));
+    CHECK(moved.fragments()[1] == "#define FOO BAR\n");
+}
+
+TEST_CASE("EvaluationPlan/no_merge_across_sections")
+{
+    // two sections which happen to be adjacent in memory are not assumed to
+    // be one span of text
+    auto text = std::make_shared<std::string>("foo\nbar\n");
+    Program prog;
+    prog.retain(text);
+    prog.append_section(Section::static_source(location(), std::string_view(*text).substr(0, 4)));
+    prog.append_section(Section::static_source(location(), std::string_view(*text).substr(4)));
+
+    Library lib;
+    EvaluationContext ctx(lib);
+    Fragments fragments = prog.evaluate(ctx);
+    CHECK(fragments.str() == "foo\nbar\n");
+    CHECK(fragments.count() == 2);
+}
+
+TEST_CASE("EvaluationContext/number_formatting")
+{
+    Library lib;
+    EvaluationContext ctx(lib);
+
+    ctx.define1f("F1", 1.0f);
+    ctx.define1f("F2", 0.1f);
+    ctx.define1f("F3", -2.5e20f);
+    ctx.define1d("D1", 0.1);
+    ctx.define1d("D2", 100.0);
+    ctx.define1ll("I1", -42);
+    ctx.define1ull("U1", 18446744073709551615ull);
+
+    auto defines = ctx.defines();
+    REQUIRE(defines.size() == 7);
+    CHECK(std::get<1>(defines[0]) == "1.0");
+    CHECK(std::get<1>(defines[1]) == "0.1");
+    CHECK(std::get<1>(defines[2]) == "-2.5e+20");
+    CHECK(std::get<1>(defines[3]) == "0.1lf");
+    CHECK(std::get<1>(defines[4]) == "100.0lf");
+    CHECK(std::get<1>(defines[5]) == "-42");
+    CHECK(std::get<1>(defines[6]) == "18446744073709551615");
+
+    CHECK_THROWS_AS(ctx.define1f("NAN", std::nanf("")), std::invalid_argument);
+}
+
+TEST_CASE("EvaluationContext/vector_defines")
+{
+    Library lib;
+    EvaluationContext ctx(lib);
+
+    ctx.define2f("V2F", 1.0f, 0.5f);
+    ctx.define3f("V3F", 0.0f, -1.0f, 1e-3f);
+    ctx.define4f("V4F", 1.0f, 2.0f, 3.0f, 4.0f);
+    ctx.define2d("V2D", 0.1, 2.0);
+    ctx.define4d("V4D", 1.0, 2.0, 3.0, 4.5);
+    ctx.define3i("V3I", -1, 0, 2147483647);
+    ctx.define2ui("V2U", 1, 4294967295u);
+    ctx.define4ui("V4U", 0, 1, 2, 3);
+
+    CHECK(ctx.define_block() ==
+          "#define V2F vec2(1.0, 0.5)\n"
+          "#define V3F vec3(0.0, -1.0, 0.001)\n"
+          "#define V4F vec4(1.0, 2.0, 3.0, 4.0)\n"
+          "#define V2D dvec2(0.1lf, 2.0lf)\n"
+          "#define V4D dvec4(1.0lf, 2.0lf, 3.0lf, 4.5lf)\n"
+          "#define V3I ivec3(-1, 0, 2147483647)\n"
+          "#define V2U uvec2(1u, 4294967295u)\n"
+          "#define V4U uvec4(0u, 1u, 2u, 3u)\n");
+}
+
+TEST_CASE("Library/memoized_evaluation")
+{
+    auto ddl = std::make_unique<DummyDataLoader>();
+    add_nested_includes(*ddl);
+    Library lib(std::move(ddl));
+
+    const Program *prog = lib.load("one.glsl");
+    const Program *lighting = lib.load("lighting.glsl");
+    REQUIRE(prog);
+    REQUIRE(lighting);
+
+    EvaluationContext ctx_a(lib);
+    ctx_a.define("FOO", "1");
+    EvaluationContext ctx_b(lib);
+    ctx_b.define("FOO", "2");
+
+    // without a budget, nothing is memoized
+    auto uncached = lib.evaluate(*prog, ctx_a);
+    CHECK(*uncached == prog->plan().evaluate(ctx_a));
+    CHECK(lib.evaluate(*prog, ctx_a) != uncached);
+    CHECK(lib.evaluation_cache_size() == 0);
+
+    lib.set_evaluation_cache_budget(1024);
+    auto a = lib.evaluate(*prog, ctx_a);
+    CHECK(*a == prog->plan().evaluate(ctx_a));
+    CHECK(lib.evaluate(*prog, ctx_a) == a);
+
+    // an equal context hits the same entry
+    EvaluationContext ctx_a2(lib);
+    ctx_a2.define("FOO", "1");
+    CHECK(lib.evaluate(*prog, ctx_a2) == a);
+
+    auto b = lib.evaluate(*prog, ctx_b);
+    CHECK(b != a);
+    CHECK(*b == prog->plan().evaluate(ctx_b));
+    auto c = lib.evaluate(*lighting, ctx_a);
+    CHECK(*c == lighting->plan().evaluate(ctx_a));
+    CHECK(lib.evaluation_cache_size() == 3);
+    CHECK(lib.evaluation_cache_bytes() == a->size() + b->size() + c->size());
+
+    // touch a, then shrink the budget so that only one more entry fits
+    lib.evaluate(*prog, ctx_a);
+    lib.set_evaluation_cache_budget(a->size() + c->size());
+    CHECK(lib.evaluation_cache_size() == 2);
+    CHECK(lib.evaluate(*prog, ctx_a) == a);
+    CHECK(lib.evaluate(*lighting, ctx_a) == c);
+    CHECK(lib.evaluate(*prog, ctx_b) != b);
+}
+
+TEST_CASE("EvaluationPlan/fingerprint")
+{
+    auto eager_ddl = std::make_unique<DummyDataLoader>();
+    add_nested_includes(*eager_ddl);
+    eager_ddl->add_source("other.glsl", "#version 330 core\n"
+                                        "light {\n"
+                                        "common\n"
+                                        "}\n"
+                                        "\n"
+                                        "main\n"
+                                        "common\n");
+    Library eager_lib(std::move(eager_ddl));
+
+    auto lazy_ddl = std::make_unique<DummyDataLoader>();
+    add_nested_includes(*lazy_ddl);
+    Library lazy_lib(std::move(lazy_ddl));
+    lazy_lib.set_lazy_includes(true);
+
+    const Program *eager = eager_lib.load("one.glsl");
+    const Program *lazy = lazy_lib.load("one.glsl");
+    // same output as one.glsl, but from a single file
+    const Program *flat = eager_lib.load("other.glsl");
+    const Program *lighting = eager_lib.load("lighting.glsl");
+    REQUIRE(eager);
+    REQUIRE(lazy);
+    REQUIRE(flat);
+    REQUIRE(lighting);
+
+    EvaluationContext ctx_a(eager_lib);
+    ctx_a.define("FOO", "1");
+    EvaluationContext ctx_a2(eager_lib);
+    ctx_a2.define("FOO", "1");
+    EvaluationContext ctx_b(eager_lib);
+    ctx_b.define("FOO", "2");
+
+    CHECK(eager->fingerprint(ctx_a) == eager->fingerprint(ctx_a2));
+    CHECK(eager->fingerprint(ctx_a) == lazy->fingerprint(ctx_a));
+    CHECK(eager->fingerprint(ctx_a) == flat->fingerprint(ctx_a));
+    CHECK(eager->fingerprint(ctx_a) != eager->fingerprint(ctx_b));
+    CHECK(eager->fingerprint(ctx_a) != lighting->fingerprint(ctx_a));
+}
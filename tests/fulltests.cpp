@@ -1,5 +1,6 @@
 #include <catch.hpp>
 
+#include <cstring>
 #include <sstream>
 
 #include "spp/spp.hpp"
@@ -23,3 +24,41 @@ TEST_CASE("fulltests/fragment_shader")
     prog->evaluate(out, ectx);
     CHECK(out.str() == std::string(test_glsl_processed));
 }
+
+TEST_CASE("fulltests/fragment_shader/simd_scanner")
+{
+    auto buffer = std::make_shared<SourceBuffer>(test_glsl, std::strlen(test_glsl));
+    Library lib;
+    EvaluationContext ectx(lib);
+
+    ParserContext flex_ctx(buffer);
+    std::unique_ptr<Program> flex_prog(flex_ctx.parse());
+    REQUIRE(flex_prog);
+
+    ParserContext simd_ctx(buffer);
+    simd_ctx.set_scanner_type(ScannerType::SIMD);
+    std::unique_ptr<Program> simd_prog(simd_ctx.parse());
+    REQUIRE(simd_prog);
+    CHECK(simd_prog->errors().empty());
+    CHECK(simd_prog->type() == ProgramType::FRAGMENT);
+    REQUIRE(simd_prog->size() == flex_prog->size());
+
+    for (Program::size_type i = 0; i < simd_prog->size(); ++i) {
+        const Section *simd_section = &(*simd_prog)[i];
+        const Section *flex_section = &(*flex_prog)[i];
+        CHECK(simd_section->kind() == flex_section->kind());
+        CHECK(simd_section->version() == flex_section->version());
+        CHECK(simd_section->text() == flex_section->text());
+        if (simd_section->kind() == SectionKind::STATIC_SOURCE) {
+            CHECK(simd_section->source().data() == flex_section->source().data());
+        }
+        CHECK(simd_section->loc().begin.line == flex_section->loc().begin.line);
+        CHECK(simd_section->loc().begin.column == flex_section->loc().begin.column);
+        CHECK(simd_section->loc().end.line == flex_section->loc().end.line);
+        CHECK(simd_section->loc().end.column == flex_section->loc().end.column);
+    }
+
+    std::ostringstream out;
+    simd_prog->evaluate(out, ectx);
+    CHECK(out.str() == std::string(test_glsl_processed));
+}
@@ -0,0 +1,33 @@
+#include <catch.hpp>
+
+#include <string>
+
+#include "spp/hash.hpp"
+
+
+using namespace spp;
+
+TEST_CASE("hash/xxh64_reference")
+{
+    CHECK(xxh64("", 0) == 0xEF46DB3751D8E999ULL);
+    CHECK(xxh64("a", 0) == 0xD24EC4F1A98C6E5BULL);
+    CHECK(xxh64("abc", 0) == 0x44BC2CF5AD770999ULL);
+    CHECK(xxh64("Nobody inspects the spammish repetition", 0) == 0xFBCEA83C8A378BF1ULL);
+}
+
+TEST_CASE("hash/xxh64_streaming")
+{
+    std::string data;
+    for (int i = 0; i < 1000; ++i) {
+        data += static_cast<char>(i * 7);
+    }
+
+    const std::uint64_t expected = xxh64(data, 42);
+    for (std::size_t step: {1, 3, 31, 32, 33, 100}) {
+        XXH64Stream stream(42);
+        for (std::size_t offset = 0; offset < data.size(); offset += step) {
+            stream.update(std::string_view(data).substr(offset, step));
+        }
+        CHECK(stream.digest() == expected);
+    }
+}
@@ -0,0 +1,801 @@
+#include <catch.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "spp/spp.hpp"
+
+
+/**
+ * Thread-safe in-memory loader which counts how often each file is opened
+ * and can hold back opening files until a number of files has been opened.
+ */
+class ConcurrentDataLoader: public spp::Loader
+{
+public:
+    explicit ConcurrentDataLoader(unsigned int rendezvous = 0):
+        m_rendezvous(rendezvous),
+        m_opened(0)
+    {
+
+    }
+
+private:
+    std::unordered_map<std::string, std::string> m_files;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    unsigned int m_rendezvous;
+    unsigned int m_opened;
+    std::unordered_map<std::string, unsigned int> m_open_counts;
+
+public:
+    void add_source(const std::string &path, const std::string &source)
+    {
+        m_files[path] = source;
+    }
+
+    unsigned int open_count(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_open_counts[path];
+    }
+
+    std::unique_ptr<std::istream> open(const std::string &path) override
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        ++m_open_counts[path];
+        ++m_opened;
+        m_cv.notify_all();
+        // give up waiting after a while so that a bug cannot hang the tests
+        m_cv.wait_for(lock, std::chrono::seconds(5),
+                      [this](){ return m_opened >= m_rendezvous; });
+
+        auto iter = m_files.find(path);
+        if (iter == m_files.end()) {
+            return nullptr;
+        }
+        return std::make_unique<std::istringstream>(iter->second);
+    }
+
+    // does not count as opening the file
+    std::optional<std::uint64_t> content_hash(const std::string &path) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_files.find(path);
+        if (iter == m_files.end()) {
+            return std::nullopt;
+        }
+        return spp::xxh64(iter->second);
+    }
+};
+
+using namespace spp;
+
+TEST_CASE("Library/concurrent_load_single_flight")
+{
+    auto loader = std::make_unique<ConcurrentDataLoader>(2);
+    ConcurrentDataLoader &ref = *loader;
+    loader->add_source("common.glsl", "#version 330 core\n"
+                                      "common\n");
+    loader->add_source("other.glsl", "#version 330 core\n"
+                                     "other\n");
+    for (int i = 0; i < 8; ++i) {
+        loader->add_source("main" + std::to_string(i) + ".glsl",
+                           "#version 330 core\n"
+                           "{% include \"common.glsl\" %}\n");
+    }
+    Library lib(std::move(loader));
+
+    std::vector<const Program*> results(8, nullptr);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&lib, &results, i]() {
+            results[i] = lib.load("main" + std::to_string(i) + ".glsl");
+        });
+    }
+    // the last thread loads an unrelated file, so that at least two loads
+    // are in flight at the same time
+    threads.emplace_back([&lib]() { lib.load("other.glsl"); });
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        REQUIRE(results[i]);
+        CHECK(results[i]->errors().empty());
+        CHECK(results[i]->plan().evaluate(EvaluationContext(lib)) ==
+              "#version 330 core\ncommon\n\n");
+    }
+    CHECK(ref.open_count("common.glsl") == 1);
+    CHECK(lib.load("main0.glsl") == results[0]);
+}
+
+TEST_CASE("Library/concurrent_recursive_include")
+{
+    // both files are opened before either is parsed, so that each thread
+    // runs into the file the other thread is loading
+    auto loader = std::make_unique<ConcurrentDataLoader>(2);
+    loader->add_source("a.glsl", "#version 330 core\n"
+                                 "{% include \"b.glsl\" %}");
+    loader->add_source("b.glsl", "#version 330 core\n"
+                                 "{% include \"a.glsl\" %}");
+    Library lib(std::move(loader));
+
+    const Program *a = nullptr;
+    const Program *b = nullptr;
+    std::thread thread_a([&lib, &a]() { a = lib.load("a.glsl"); });
+    std::thread thread_b([&lib, &b]() { b = lib.load("b.glsl"); });
+    thread_a.join();
+    thread_b.join();
+
+    REQUIRE(a);
+    REQUIRE(b);
+    CHECK_FALSE(a->errors().empty());
+    CHECK_FALSE(b->errors().empty());
+
+    bool recursion_reported = false;
+    for (auto &error: a->errors()) {
+        if (std::get<2>(error).find("recursive inclusion") != std::string::npos) {
+            recursion_reported = true;
+        }
+    }
+    CHECK(recursion_reported);
+}
+
+TEST_CASE("Library/concurrent_evaluate")
+{
+    auto loader = std::make_unique<ConcurrentDataLoader>();
+    loader->add_source("main.glsl", "#version 330 core\n"
+                                    "main\n");
+    Library lib(std::move(loader));
+    lib.set_evaluation_cache_budget(1 << 16);
+
+    const Program *prog = lib.load("main.glsl");
+    REQUIRE(prog);
+
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&lib, &mismatches, prog, i]() {
+            for (int j = 0; j < 100; ++j) {
+                EvaluationContext ctx(lib);
+                ctx.define1ll("VARIANT", (i * 100 + j) % 16);
+                auto output = lib.evaluate(*prog, ctx);
+                if (*output != prog->plan().evaluate(ctx)) {
+                    ++mismatches;
+                }
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    CHECK(mismatches == 0);
+    CHECK(lib.evaluation_cache_size() == 16);
+}
+
+static void add_include_graph(ConcurrentDataLoader &loader)
+{
+    loader.add_source("main.glsl", "#version 330 core\n"
+                                   "{% include \"a.glsl\" %}\n"
+                                   "{% include \"b.glsl\" %}\n"
+                                   "{% include \"missing.glsl\" %}\n"
+                                   "{% include \"loop.glsl\" %}\n"
+                                   "main\n");
+    loader.add_source("a.glsl", "#version 330 core\n"
+                                "{% include \"common.glsl\" %}\n"
+                                "a\n");
+    loader.add_source("b.glsl", "#version 330 core\n"
+                                "{% include \"common.glsl\" %}\n"
+                                "b\n");
+    loader.add_source("common.glsl", "#version 330 core\n"
+                                     "common\n");
+    loader.add_source("loop.glsl", "#version 330 core\n"
+                                   "{% include \"main.glsl\" %}\n");
+}
+
+TEST_CASE("Library/parallel_includes")
+{
+    auto serial_loader = std::make_unique<ConcurrentDataLoader>();
+    add_include_graph(*serial_loader);
+    Library serial(std::move(serial_loader));
+    const Program *expected = serial.load("main.glsl");
+    REQUIRE(expected);
+
+    for (int i = 0; i < 50; ++i) {
+        auto loader = std::make_unique<ConcurrentDataLoader>();
+        ConcurrentDataLoader &ref = *loader;
+        add_include_graph(*loader);
+        Library lib(std::move(loader));
+        lib.set_thread_pool(std::make_shared<ThreadPool>(4));
+
+        const Program *prog = lib.load("main.glsl");
+        REQUIRE(prog);
+        CHECK(prog->plan().evaluate(EvaluationContext(lib)) ==
+              expected->plan().evaluate(EvaluationContext(serial)));
+        REQUIRE(prog->errors().size() == expected->errors().size());
+        for (std::size_t j = 0; j < prog->errors().size(); ++j) {
+            CHECK(std::get<2>(prog->errors()[j]) == std::get<2>(expected->errors()[j]));
+        }
+        CHECK(ref.open_count("common.glsl") == 1);
+        CHECK(ref.open_count("a.glsl") == 1);
+    }
+}
+
+TEST_CASE("Library/parallel_includes_concurrent_first_load")
+{
+    const std::vector<std::string> files{"main.glsl", "a.glsl", "b.glsl", "common.glsl"};
+    for (int round = 0; round < 50; ++round) {
+        auto loader = std::make_unique<ConcurrentDataLoader>();
+        ConcurrentDataLoader &ref = *loader;
+        add_include_graph(*loader);
+        Library lib(std::move(loader));
+        lib.set_thread_pool(std::make_shared<ThreadPool>(4));
+
+        // all threads start loading the same uncached files at once, while
+        // the includes of main.glsl are being prefetched
+        std::atomic<bool> start(false);
+        std::atomic<int> failures(0);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 8; ++i) {
+            threads.emplace_back([&lib, &files, &start, &failures, i]() {
+                while (!start) {
+                    std::this_thread::yield();
+                }
+                for (std::size_t j = 0; j < files.size(); ++j) {
+                    try {
+                        if (!lib.load(files[(i + j) % files.size()])) {
+                            ++failures;
+                        }
+                    } catch (...) {
+                        ++failures;
+                    }
+                }
+            });
+        }
+        start = true;
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        CHECK(failures == 0);
+        for (auto &file: files) {
+            CHECK(ref.open_count(file) == 1);
+        }
+    }
+}
+
+TEST_CASE("Library/invalidate")
+{
+    auto loader = std::make_unique<ConcurrentDataLoader>();
+    ConcurrentDataLoader &ref = *loader;
+    add_include_graph(*loader);
+    loader->add_source("other.glsl", "#version 330 core\n"
+                                     "{% include \"b.glsl\" %}\n");
+    loader->add_source("unrelated.glsl", "#version 330 core\n"
+                                         "unrelated\n");
+    Library lib(std::move(loader));
+
+    std::shared_ptr<const Program> main = lib.acquire("main.glsl");
+    const Program *unrelated = lib.load("unrelated.glsl");
+    REQUIRE(main);
+    REQUIRE(unrelated);
+    lib.load("other.glsl");
+
+    SECTION("reparses the file and its includers")
+    {
+        ref.add_source("common.glsl", "#version 330 core\n"
+                                      "changed\n");
+        auto reloaded = lib.invalidate("common.glsl");
+        REQUIRE(reloaded.size() == 2);
+        CHECK(reloaded[0]->source_path() == "main.glsl");
+        CHECK(reloaded[1]->source_path() == "other.glsl");
+        CHECK(reloaded[0] != main);
+        CHECK(reloaded[0]->plan().evaluate(EvaluationContext(lib)).find("changed") !=
+              std::string::npos);
+        // the previous program stays valid as long as it is referenced
+        CHECK(main->plan().evaluate(EvaluationContext(lib)).find("changed") ==
+              std::string::npos);
+
+        CHECK(ref.open_count("common.glsl") == 2);
+        CHECK(ref.open_count("a.glsl") == 2);
+        CHECK(ref.open_count("unrelated.glsl") == 1);
+        CHECK(lib.load("unrelated.glsl") == unrelated);
+        CHECK(lib.load("main.glsl") == reloaded[0].get());
+    }
+
+    SECTION("follows the reloaded include graph")
+    {
+        ref.add_source("b.glsl", "#version 330 core\n"
+                                 "b\n");
+        REQUIRE(lib.invalidate("b.glsl").size() == 2);
+        // main no longer includes common through b, but still through a
+        CHECK(lib.invalidate("common.glsl").size() == 1);
+        CHECK(lib.invalidate("b.glsl").size() == 2);
+    }
+
+    SECTION("reloads includers of files which failed to load")
+    {
+        ref.add_source("missing.glsl", "#version 330 core\n"
+                                       "found\n");
+        auto reloaded = lib.invalidate("missing.glsl");
+        REQUIRE(reloaded.size() == 1);
+        CHECK(reloaded[0]->plan().evaluate(EvaluationContext(lib)).find("found") !=
+              std::string::npos);
+    }
+}
+
+#ifdef __linux__
+TEST_CASE("LibraryWatcher/reload_changed_file")
+{
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() /
+            ("spp-watcher-" + std::to_string(::getpid()));
+    fs::create_directories(dir);
+    const std::string main_path = (dir / "main.glsl").string();
+    const std::string common_path = (dir / "common.glsl").string();
+    std::ofstream(main_path) << "#version 330 core\n"
+                                "{% include \"" << common_path << "\" %}\n";
+    std::ofstream(common_path) << "#version 330 core\n"
+                                  "before\n";
+
+    Library lib;
+    LibraryWatcher watcher(lib);
+    watcher.watch(main_path);
+    watcher.watch(common_path);
+    REQUIRE(lib.load(main_path));
+    CHECK(watcher.poll().empty());
+
+    std::ofstream(common_path) << "#version 330 core\n"
+                                  "after\n";
+    auto reloaded = watcher.poll(1000);
+    REQUIRE(reloaded.size() == 1);
+    CHECK(reloaded[0]->plan().evaluate(EvaluationContext(lib)) ==
+          "#version 330 core\nafter\n\n");
+
+    fs::remove_all(dir);
+}
+#endif
+
+TEST_CASE("Library/disk_cache")
+{
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() /
+            ("spp-disk-cache-" + std::to_string(std::random_device()()));
+    fs::create_directories(dir);
+
+    for (bool lazy: {false, true}) {
+        auto make_library = [&dir, lazy](ConcurrentDataLoader *&ref) {
+            auto loader = std::make_unique<ConcurrentDataLoader>();
+            ref = loader.get();
+            add_include_graph(*loader);
+            auto lib = std::make_unique<Library>(std::move(loader));
+            lib->set_lazy_includes(lazy);
+            lib->set_disk_cache(dir.string());
+            return lib;
+        };
+
+        ConcurrentDataLoader *first_loader;
+        auto first = make_library(first_loader);
+        const Program *parsed = first->load("main.glsl");
+        REQUIRE(parsed);
+        const std::string expected = parsed->plan().evaluate(EvaluationContext(*first));
+
+        ConcurrentDataLoader *second_loader;
+        auto second = make_library(second_loader);
+        const Program *cached = second->load("main.glsl");
+        REQUIRE(cached);
+        CHECK(cached->plan().evaluate(EvaluationContext(*second)) == expected);
+        REQUIRE(cached->errors().size() == parsed->errors().size());
+        CHECK(second_loader->open_count("main.glsl") == 0);
+        CHECK(second_loader->open_count("common.glsl") == 0);
+
+        // the include graph is restored from the cache
+        second_loader->add_source("common.glsl", "#version 330 core\n"
+                                                 "changed\n");
+        auto reloaded = second->invalidate("common.glsl");
+        REQUIRE(reloaded.size() == 1);
+        CHECK(reloaded[0]->plan().evaluate(EvaluationContext(*second)).find("changed") !=
+              std::string::npos);
+        CHECK(second_loader->open_count("main.glsl") == 1);
+
+        // a changed dependency makes the entry stale
+        ConcurrentDataLoader *third_loader;
+        auto third = make_library(third_loader);
+        third_loader->add_source("b.glsl", "#version 330 core\n"
+                                           "other b\n");
+        const Program *stale = third->load("main.glsl");
+        REQUIRE(stale);
+        CHECK(stale->plan().evaluate(EvaluationContext(*third)).find("other b") !=
+              std::string::npos);
+        CHECK(third_loader->open_count("main.glsl") == 1);
+    }
+
+    fs::remove_all(dir);
+}
+
+TEST_CASE("Library/program_cache_budget")
+{
+    auto loader = std::make_unique<ConcurrentDataLoader>();
+    ConcurrentDataLoader &ref = *loader;
+    for (int i = 0; i < 8; ++i) {
+        loader->add_source("file" + std::to_string(i) + ".glsl",
+                           "#version 330 core\n" + std::string(1000, 'a' + i) + "\n");
+    }
+    Library lib(std::move(loader));
+
+    std::shared_ptr<const Program> held = lib.acquire("file0.glsl");
+    REQUIRE(held);
+    const std::size_t program_size = held->memory_usage();
+    lib.set_program_cache_budget(program_size * 3);
+
+    for (int i = 1; i < 8; ++i) {
+        REQUIRE(lib.load("file" + std::to_string(i) + ".glsl"));
+        // keep file1 recently used
+        REQUIRE(lib.load("file1.glsl"));
+    }
+
+    Library::ProgramCacheStats stats = lib.program_cache_stats();
+    CHECK(stats.bytes <= program_size * 3);
+    CHECK(stats.evictions == 5);
+    CHECK(stats.misses == 8);
+    CHECK(stats.hits == 7);
+
+    // the held program and the recently used one survive
+    CHECK(lib.acquire("file0.glsl") == held);
+    lib.load("file1.glsl");
+    CHECK(ref.open_count("file1.glsl") == 1);
+    // evicted programs are loaded again
+    lib.load("file2.glsl");
+    CHECK(ref.open_count("file2.glsl") == 2);
+}
+
+TEST_CASE("Library/program_memory_usage")
+{
+    auto loader = std::make_unique<ConcurrentDataLoader>();
+    loader->add_source("header.glsl", "#version 330 core\n" + std::string(10000, 'x') + "\n");
+    loader->add_source("main.glsl", "#version 330 core\n"
+                                    "{% include \"header.glsl\" %}\n"
+                                    "main\n");
+    Library lib(std::move(loader));
+
+    std::shared_ptr<const Program> main = lib.acquire("main.glsl");
+    std::shared_ptr<const Program> header = lib.acquire("header.glsl");
+    REQUIRE(main);
+    REQUIRE(header);
+    REQUIRE(main->errors().empty());
+
+    // the included text is charged to the header only
+    CHECK(header->memory_usage() > 10000);
+    CHECK(main->memory_usage() < 10000);
+    CHECK(lib.program_cache_stats().bytes ==
+          main->memory_usage() + header->memory_usage());
+}
+
+TEST_CASE("Library/program_cache_budget_all_in_use")
+{
+    auto loader = std::make_unique<ConcurrentDataLoader>();
+    for (int i = 0; i < 256; ++i) {
+        loader->add_source("file" + std::to_string(i) + ".glsl",
+                           "#version 330 core\n" + std::string(100, 'x') + "\n");
+    }
+    Library lib(std::move(loader));
+    lib.set_program_cache_budget(1);
+
+    std::vector<std::shared_ptr<const Program> > held;
+    for (int i = 0; i < 256; ++i) {
+        held.emplace_back(lib.acquire("file" + std::to_string(i) + ".glsl"));
+        REQUIRE(held.back());
+    }
+
+    // nothing can be evicted; the cache is not scanned on every load
+    Library::ProgramCacheStats stats = lib.program_cache_stats();
+    CHECK(stats.evictions == 0);
+    CHECK(stats.scans > 0);
+    CHECK(stats.scans < 64);
+
+    // cache hits do not scan, even if programs were released, but setting
+    // the budget does
+    held.clear();
+    for (int i = 0; i < 256; ++i) {
+        lib.load("file" + std::to_string(i) + ".glsl");
+    }
+    stats = lib.program_cache_stats();
+    CHECK(stats.evictions == 0);
+    lib.set_program_cache_budget(1);
+    stats = lib.program_cache_stats();
+    CHECK(stats.evictions == 256);
+    CHECK(stats.bytes == 0);
+}
+
+/**
+ * In-memory loader which treats lexically equal paths as the same file.
+ */
+class LexicalDataLoader: public ConcurrentDataLoader
+{
+public:
+    std::atomic<unsigned int> canonical_calls{0};
+
+public:
+    std::unique_ptr<std::istream> open(const std::string &path) override
+    {
+        return ConcurrentDataLoader::open(normalize(path));
+    }
+
+    std::string canonical(const std::string &path) override
+    {
+        ++canonical_calls;
+        return normalize(path);
+    }
+
+    static std::string normalize(const std::string &path)
+    {
+        return std::filesystem::path(path).lexically_normal().generic_string();
+    }
+
+};
+
+TEST_CASE("Library/canonical_paths")
+{
+    auto loader = std::make_unique<LexicalDataLoader>();
+    ConcurrentDataLoader &ref = *loader;
+    loader->add_source("common.glsl", "#version 330 core\n"
+                                      "common\n");
+    loader->add_source("main.glsl", "#version 330 core\n"
+                                    "{% include \"./common.glsl\" %}\n"
+                                    "{% include \"lib/../common.glsl\" %}\n");
+    Library lib(std::move(loader));
+
+    const Program *main = lib.load("main.glsl");
+    REQUIRE(main);
+    CHECK(main->errors().empty());
+    CHECK(lib.load("common.glsl") == lib.load("./common.glsl"));
+    CHECK(ref.open_count("common.glsl") == 1);
+    CHECK(ref.open_count("./common.glsl") == 0);
+
+    // invalidating through another spelling of the path works, too
+    REQUIRE(lib.invalidate("./common.glsl").size() == 2);
+}
+
+TEST_CASE("Library/canonical_once_per_include")
+{
+    for (bool parallel: {false, true}) {
+        auto loader = std::make_unique<LexicalDataLoader>();
+        LexicalDataLoader &ref = *loader;
+        loader->add_source("common.glsl", "#version 330 core\n"
+                                          "common\n");
+        loader->add_source("main.glsl", "#version 330 core\n"
+                                        "{% include \"./common.glsl\" %}\n"
+                                        "{% include \"lib/../common.glsl\" %}\n");
+        Library lib(std::move(loader));
+        if (parallel) {
+            lib.set_thread_pool(std::make_shared<ThreadPool>(2));
+        }
+
+        REQUIRE(lib.load("main.glsl"));
+        // once for main.glsl and once for each include
+        CHECK(ref.canonical_calls == 3);
+    }
+}
+
+#ifdef __linux__
+TEST_CASE("Library/canonical_paths_symlink")
+{
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() /
+            ("spp-symlink-" + std::to_string(std::random_device()()));
+    fs::create_directories(dir / "elsewhere" / "inner");
+    fs::create_directory_symlink(dir / "elsewhere" / "inner", dir / "lib");
+    std::ofstream((dir / "common.glsl").string()) << "#version 330 core\n"
+                                                    "common\n";
+    std::ofstream((dir / "elsewhere" / "common.glsl").string()) << "#version 330 core\n"
+                                                                  "elsewhere\n";
+
+    Library lib;
+    const std::string common_path = (dir / "common.glsl").string();
+    // ".." is resolved after the symlink, so this is elsewhere/common.glsl
+    const std::string linked_path = (dir / "lib" / ".." / "common.glsl").string();
+    const Program *common = lib.load(common_path);
+    const Program *linked = lib.load(linked_path);
+    REQUIRE(common);
+    REQUIRE(linked);
+    CHECK(common->errors().empty());
+    CHECK(linked->errors().empty());
+    CHECK(common != linked);
+    REQUIRE(common->size() == 2);
+    REQUIRE(linked->size() == 2);
+    CHECK((*common)[1].source() == "common\n");
+    CHECK((*linked)[1].source() == "elsewhere\n");
+    // files are opened by the path as requested
+    CHECK(linked->source_path() == linked_path);
+
+    CHECK(lib.load((dir / "." / "common.glsl").string()) == common);
+    CHECK(lib.load((dir / "elsewhere" / "common.glsl").string()) == linked);
+
+    fs::remove_all(dir);
+}
+#endif
+
+TEST_CASE("Library/content_deduplication")
+{
+    auto loader = std::make_unique<ConcurrentDataLoader>();
+    const std::string source = "#version 330 core\n"
+                               "{% include \"common.glsl\" %}\n"
+                               "main\n";
+    loader->add_source("common.glsl", "#version 330 core\n"
+                                      "common\n");
+    loader->add_source("a/main.glsl", source);
+    loader->add_source("b/main.glsl", source);
+    ConcurrentDataLoader &ref = *loader;
+    Library lib(std::move(loader));
+
+    const Program *a = lib.load("a/main.glsl");
+    const Program *b = lib.load("b/main.glsl");
+    REQUIRE(a);
+    REQUIRE(b);
+    CHECK(a != b);
+    CHECK(b->source_path() == "b/main.glsl");
+    REQUIRE(a->size() == b->size());
+    for (Program::size_type i = 0; i < a->size(); ++i) {
+        // the text is shared instead of parsed twice
+        CHECK((*a)[i].text().data() == (*b)[i].text().data());
+    }
+    CHECK(a->plan().evaluate(EvaluationContext(lib)) ==
+          b->plan().evaluate(EvaluationContext(lib)));
+
+    // both copies depend on the included file
+    ref.add_source("common.glsl", "#version 330 core\n"
+                                  "changed\n");
+    auto reloaded = lib.invalidate("common.glsl");
+    REQUIRE(reloaded.size() == 2);
+    for (auto &program: reloaded) {
+        CHECK(program->plan().evaluate(EvaluationContext(lib)).find("changed") !=
+              std::string::npos);
+    }
+}
+
+TEST_CASE("Library/preload")
+{
+    auto loader = std::make_unique<ConcurrentDataLoader>();
+    ConcurrentDataLoader &ref = *loader;
+    add_include_graph(*loader);
+    std::string manifest = "# shaders to warm up\n"
+                           "\n";
+    for (int i = 0; i < 32; ++i) {
+        const std::string path = "shader" + std::to_string(i) + ".glsl";
+        loader->add_source(path, "#version 330 core\n"
+                                 "{% include \"a.glsl\" %}\n"
+                                 "{% include \"b.glsl\" %}\n");
+        manifest += "  " + path + "\n";
+    }
+    manifest += "main.glsl\n"
+                "nonexistent.glsl\n";
+    loader->add_source("manifest.txt", manifest);
+    Library lib(std::move(loader));
+
+    auto failures = lib.preload_manifest("manifest.txt", 4);
+    REQUIRE(failures.size() == 2);
+    CHECK(failures[0].path == "main.glsl");
+    CHECK(failures[0].errors.size() == 2);
+    CHECK(failures[1].path == "nonexistent.glsl");
+    CHECK(failures[1].errors.size() == 1);
+
+    for (int i = 0; i < 32; ++i) {
+        CHECK(ref.open_count("shader" + std::to_string(i) + ".glsl") == 1);
+    }
+    CHECK(ref.open_count("common.glsl") == 1);
+
+    // the cache is warm
+    const Library::ProgramCacheStats before = lib.program_cache_stats();
+    REQUIRE(lib.load("shader7.glsl"));
+    CHECK(lib.program_cache_stats().misses == before.misses);
+
+    CHECK_THROWS_AS(lib.preload_manifest("missing.txt"), std::runtime_error);
+    CHECK(lib.preload({}).empty());
+}
+
+/**
+ * Loader which hands out buffers referring to its own memory.
+ */
+class BufferLoader: public spp::Loader
+{
+private:
+    std::unordered_map<std::string, std::string> m_files;
+
+public:
+    void add_source(const std::string &path, const std::string &source)
+    {
+        m_files[path] = source;
+    }
+
+    const std::string &source(const std::string &path)
+    {
+        return m_files.at(path);
+    }
+
+    std::unique_ptr<std::istream> open(const std::string &) override
+    {
+        throw std::logic_error("open() must not be used");
+    }
+
+    std::shared_ptr<const spp::SourceBuffer> open_buffer(const std::string &path) override
+    {
+        auto iter = m_files.find(path);
+        if (iter == m_files.end()) {
+            return nullptr;
+        }
+        return std::make_shared<spp::SourceBuffer>(iter->second.data(), iter->second.size());
+    }
+};
+
+TEST_CASE("Library/load_from_buffers")
+{
+    auto loader = std::make_unique<BufferLoader>();
+    loader->add_source("main.glsl", "#version 330 core\n"
+                                    "main\n");
+    BufferLoader &ref = *loader;
+    Library lib(std::move(loader));
+
+    const Program *prog = lib.load("main.glsl");
+    REQUIRE(prog);
+    REQUIRE(prog->size() == 2);
+    // the text is not copied out of the loader's buffer
+    const std::string &source = ref.source("main.glsl");
+    CHECK((*prog)[1].source().data() == source.data() + source.find("main"));
+}
+
+#ifdef __linux__
+TEST_CASE("MmapLoader/open_buffer")
+{
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() /
+            ("spp-mmap-" + std::to_string(std::random_device()()));
+    fs::create_directories(dir);
+    const std::string main_path = (dir / "main.glsl").string();
+    const std::string empty_path = (dir / "empty.glsl").string();
+    const std::string source = "#version 330 core\n"
+                               "main\n";
+    std::ofstream(main_path) << source;
+    std::ofstream(empty_path).flush();
+
+    MmapLoader loader;
+    auto buffer = loader.open_buffer(main_path);
+    REQUIRE(buffer);
+    CHECK(buffer->view() == source);
+    CHECK(loader.content_hash(main_path) == xxh64(source));
+
+    auto empty = loader.open_buffer(empty_path);
+    REQUIRE(empty);
+    CHECK(empty->size() == 0);
+
+    CHECK_FALSE(loader.open_buffer((dir / "missing.glsl").string()));
+    CHECK_FALSE(loader.open((dir / "missing.glsl").string()));
+    CHECK_FALSE(loader.content_hash((dir / "missing.glsl").string()));
+
+    Library lib(std::make_unique<MmapLoader>());
+    const Program *prog = lib.load(main_path);
+    REQUIRE(prog);
+    CHECK(prog->plan().evaluate(EvaluationContext(lib)) == "#version 330 core\nmain\n");
+    CHECK_FALSE(lib.load((dir / "missing.glsl").string()));
+
+    // the default loader reads files instead of mapping them
+    Library default_lib;
+    const Program *missing = default_lib.load((dir / "missing.glsl").string());
+    REQUIRE(missing);
+    CHECK_FALSE(missing->errors().empty());
+
+    fs::remove_all(dir);
+}
+#endif
@@ -35,8 +35,8 @@ TEST_CASE("parser/version_directive/fragment")
     REQUIRE(prog->size() >= 1);
     CHECK(prog->size() == 1);
 
-    VersionDeclaration *version = dynamic_cast<VersionDeclaration*>(&(*prog)[0]);
-    REQUIRE(version);
+    const Section *version = &(*prog)[0];
+    REQUIRE(version->kind() == SectionKind::VERSION);
     CHECK(version->type() == ProgramType::FRAGMENT);
     CHECK(version->version() == 330);
     CHECK(version->profile() == "core");
@@ -56,8 +56,8 @@ TEST_CASE("parser/version_directive/vertex")
     REQUIRE(prog->size() >= 1);
     CHECK(prog->size() == 1);
 
-    VersionDeclaration *version = dynamic_cast<VersionDeclaration*>(&(*prog)[0]);
-    REQUIRE(version);
+    const Section *version = &(*prog)[0];
+    REQUIRE(version->kind() == SectionKind::VERSION);
     CHECK(version->type() == ProgramType::VERTEX);
     CHECK(version->version() == 330);
     CHECK(version->profile() == "core");
@@ -77,8 +77,8 @@ TEST_CASE("parser/version_directive/without_type")
     REQUIRE(prog->size() >= 1);
     CHECK(prog->size() == 1);
 
-    VersionDeclaration *version = dynamic_cast<VersionDeclaration*>(&(*prog)[0]);
-    REQUIRE(version);
+    const Section *version = &(*prog)[0];
+    REQUIRE(version->kind() == SectionKind::VERSION);
     CHECK(version->type() == ProgramType::GENERIC);
     CHECK(version->version() == 330);
     CHECK(version->profile() == "core");
@@ -97,8 +97,8 @@ TEST_CASE("parser/version_directive/without_trailing_newline")
     REQUIRE(prog->size() >= 1);
     CHECK(prog->size() == 1);
 
-    VersionDeclaration *version = dynamic_cast<VersionDeclaration*>(&(*prog)[0]);
-    REQUIRE(version);
+    const Section *version = &(*prog)[0];
+    REQUIRE(version->kind() == SectionKind::VERSION);
     CHECK(version->type() == ProgramType::VERTEX);
     CHECK(version->version() == 330);
     CHECK(version->profile() == "core");
@@ -119,8 +119,8 @@ TEST_CASE("parser/version_directive/tesselation")
     REQUIRE(prog->size() >= 1);
     CHECK(prog->size() == 1);
 
-    VersionDeclaration *version = dynamic_cast<VersionDeclaration*>(&(*prog)[0]);
-    REQUIRE(version);
+    const Section *version = &(*prog)[0];
+    REQUIRE(version->kind() == SectionKind::VERSION);
     CHECK(version->type() == ProgramType::TESSELATION);
     CHECK(version->version() == 330);
     CHECK(version->profile() == "core");
@@ -140,8 +140,8 @@ TEST_CASE("parser/version_directive/geometry")
     REQUIRE(prog->size() >= 1);
     CHECK(prog->size() == 1);
 
-    VersionDeclaration *version = dynamic_cast<VersionDeclaration*>(&(*prog)[0]);
-    REQUIRE(version);
+    const Section *version = &(*prog)[0];
+    REQUIRE(version->kind() == SectionKind::VERSION);
     CHECK(version->type() == ProgramType::GEOMETRY);
     CHECK(version->version() == 330);
     CHECK(version->profile() == "core");
@@ -162,8 +162,8 @@ TEST_CASE("parser/include_directive")
     REQUIRE(prog->size() >= 2);
     CHECK(prog->size() == 3);
 
-    IncludeDirective *include = dynamic_cast<IncludeDirective*>(&(*prog)[1]);
-    REQUIRE(include);
+    const Section *include = &(*prog)[1];
+    REQUIRE(include->kind() == SectionKind::INCLUDE);
     CHECK(include->path() == std::string("some \"string\" with \n magic"));
 }
 
@@ -178,7 +178,7 @@ TEST_CASE("parser/include_directive/incorrect_escape_sequence")
     std::unique_ptr<Program> prog(ctx.parse());
     REQUIRE(prog);
     CHECK_FALSE(prog->errors().empty());
-    CHECK(prog->size() == 4);
+    CHECK(prog->size() == 3);
 }
 
 TEST_CASE("parser/include_directive/without_terminating_newline")
@@ -195,8 +195,26 @@ TEST_CASE("parser/include_directive/without_terminating_newline")
     REQUIRE(prog->size() >= 2);
     CHECK(prog->size() == 2);
 
-    IncludeDirective *include = dynamic_cast<IncludeDirective*>(&(*prog)[1]);
-    REQUIRE(include);
+    const Section *include = &(*prog)[1];
+    REQUIRE(include->kind() == SectionKind::INCLUDE);
+    CHECK(include->path() == std::string("foobar"));
+}
+
+TEST_CASE("parser/include_once_directive")
+{
+    std::istringstream data("#version 330 core fragment\n"
+                            "{% include_once \"foobar\" %}\n"
+                            "{% include_once_not \"foobar\" %}\n");
+
+    ParserContext ctx(data);
+    std::unique_ptr<Program> prog(ctx.parse());
+    REQUIRE(prog);
+    // the second directive is not a keyword
+    CHECK(prog->errors().size() == 1);
+
+    REQUIRE(prog->size() >= 2);
+    const Section *include = &(*prog)[1];
+    REQUIRE(include->kind() == SectionKind::INCLUDE_ONCE);
     CHECK(include->path() == std::string("foobar"));
 }
 
@@ -212,7 +230,7 @@ TEST_CASE("parser/sourcecode")
     std::unique_ptr<Program> prog(ctx.parse());
     REQUIRE(prog);
     CHECK(prog->errors().empty());
-    CHECK(prog->size() == 3);
+    CHECK(prog->size() == 2);
 
     std::string expected("#version 330 core\n"
                          "foo bar\n"
@@ -254,7 +272,7 @@ TEST_CASE("parser/sourcecode/c++_style_comments")
     std::unique_ptr<Program> prog(ctx.parse());
     REQUIRE(prog);
     CHECK(prog->errors().empty());
-    CHECK(prog->size() == 3);
+    CHECK(prog->size() == 2);
 
     std::string expected("#version 330 core\n"
                          "foo // baz \"foofoo\"\n"
@@ -276,7 +294,7 @@ TEST_CASE("parser/sourcecode/c_style_comments")
     std::unique_ptr<Program> prog(ctx.parse());
     REQUIRE(prog);
     CHECK(prog->errors().empty());
-    CHECK(prog->size() == 3);
+    CHECK(prog->size() == 2);
 
     std::string expected("#version 330 core\n"
                          "foo /* baz \"foofoo\"\n"
@@ -296,10 +314,238 @@ TEST_CASE("parser/version_declaration/recover_missing")
     std::unique_ptr<Program> prog(ctx.parse());
     REQUIRE(prog);
     CHECK(!prog->errors().empty());
-    CHECK(prog->size() == 2);
+    CHECK(prog->size() == 1);
 
     std::string expected("foobar\nbaz\n");
     std::ostringstream evaluated;
     prog->evaluate(evaluated, ectx);
     CHECK(evaluated.str() == expected);
 }
+
+TEST_CASE("parser/sourcecode/coalesce_lines")
+{
+    std::istringstream data("#version 330 core fragment\n"
+                            "foo\n"
+                            "{ bar }\n"
+                            "{% include \"baz\" %}\n"
+                            "fnord\n"
+                            "{}\n");
+
+    ParserContext ctx(data);
+    std::unique_ptr<Program> prog(ctx.parse());
+    REQUIRE(prog);
+    CHECK(prog->errors().empty());
+    REQUIRE(prog->size() == 4);
+
+    const Section *section = &(*prog)[1];
+    REQUIRE(section->kind() == SectionKind::STATIC_SOURCE);
+    CHECK(section->source() == "foo\n{ bar }\n");
+
+    section = &(*prog)[3];
+    REQUIRE(section->kind() == SectionKind::STATIC_SOURCE);
+    CHECK(section->source() == "\nfnord\n{}\n");
+    CHECK(section->loc().end.line == 7);
+}
+
+TEST_CASE("parser/source_buffer/sections_refer_to_buffer")
+{
+    static const char source[] = "#version 330 core fragment\n"
+                                 "foo bar\n"
+                                 "baz";
+
+    auto buffer = std::make_shared<SourceBuffer>(source, sizeof(source)-1);
+    ParserContext ctx(buffer);
+    std::unique_ptr<Program> prog(ctx.parse());
+    REQUIRE(prog);
+    CHECK(prog->errors().empty());
+    REQUIRE(prog->size() >= 2);
+
+    const Section *section = &(*prog)[1];
+    REQUIRE(section->kind() == SectionKind::STATIC_SOURCE);
+    CHECK(section->source() == "foo bar\nbaz");
+    CHECK(section->source().data() >= &source[0]);
+    CHECK(section->source().data() < &source[sizeof(source)-1]);
+}
+
+TEST_CASE("parser/source_buffer/program_retains_buffer")
+{
+    std::unique_ptr<Program> prog;
+    {
+        std::istringstream data("#version 330 core fragment\n"
+                                "foo bar\n");
+        ParserContext ctx(data);
+        prog = ctx.parse();
+    }
+    REQUIRE(prog);
+    CHECK(prog->errors().empty());
+    CHECK(prog->retained().size() == 1);
+
+    Library lib;
+    EvaluationContext ectx(lib);
+    std::ostringstream evaluated;
+    prog->evaluate(evaluated, ectx);
+    CHECK(evaluated.str() == "#version 330 core\nfoo bar\n");
+}
+
+static void check_same_sections(const Program &simd_prog, const Program &flex_prog)
+{
+    REQUIRE(simd_prog.size() == flex_prog.size());
+    for (Program::size_type i = 0; i < simd_prog.size(); ++i) {
+        const Section &simd_section = simd_prog[i];
+        const Section &flex_section = flex_prog[i];
+        CHECK(simd_section.kind() == flex_section.kind());
+        CHECK(simd_section.text() == flex_section.text());
+        CHECK(simd_section.version() == flex_section.version());
+        CHECK(simd_section.loc().begin.line == flex_section.loc().begin.line);
+        CHECK(simd_section.loc().begin.column == flex_section.loc().begin.column);
+        CHECK(simd_section.loc().end.line == flex_section.loc().end.line);
+        CHECK(simd_section.loc().end.column == flex_section.loc().end.column);
+    }
+}
+
+TEST_CASE("parser/simd_scanner/matches_flex")
+{
+    const std::string source("#version 330 core fragment\n"
+                             "foo { bar }\n"
+                             "{% include \"a\" %}{% include \"b\" %}\n"
+                             "{\n"
+                             "baz {% include \"c\" %}\n"
+                             "{");
+    auto buffer = std::make_shared<SourceBuffer>(source.data(), source.size());
+    Library lib;
+    EvaluationContext ectx(lib);
+
+    ParserContext flex_ctx(buffer);
+    std::unique_ptr<Program> flex_prog(flex_ctx.parse());
+    REQUIRE(flex_prog);
+    CHECK(flex_prog->errors().empty());
+
+    ParserContext simd_ctx(buffer);
+    simd_ctx.set_scanner_type(ScannerType::SIMD);
+    std::unique_ptr<Program> simd_prog(simd_ctx.parse());
+    REQUIRE(simd_prog);
+    CHECK(simd_prog->errors().empty());
+    dump_errors(simd_prog->errors().begin(), simd_prog->errors().end());
+
+    REQUIRE(simd_prog->size() == flex_prog->size());
+    CHECK(simd_prog->size() == 7);
+
+    const Section *include = &(*simd_prog)[3];
+    REQUIRE(include->kind() == SectionKind::INCLUDE);
+    CHECK(include->path() == "b");
+
+    const Section *section = &(*simd_prog)[4];
+    REQUIRE(section->kind() == SectionKind::STATIC_SOURCE);
+    CHECK(section->source() == "\n{\nbaz ");
+
+    section = &(*simd_prog)[6];
+    REQUIRE(section->kind() == SectionKind::STATIC_SOURCE);
+    CHECK(section->source() == "\n{");
+
+    check_same_sections(*simd_prog, *flex_prog);
+}
+
+TEST_CASE("parser/simd_scanner/long_input")
+{
+    // longer than what the SIMD scanner lets flex read at once, so that
+    // directives are split across refills of the flex buffer
+    std::string source("#version 330 core\n");
+    for (int i = 0; i < 64; ++i) {
+        source += "vec4 color" + std::to_string(i) + " = vec4(1.0); { }\n";
+        source += "{% include \"file" + std::to_string(i) + "\" %}";
+        if (i % 3 == 0) {
+            source += "\n";
+        }
+    }
+    source += "{";
+    REQUIRE(source.size() > 1024);
+    auto buffer = std::make_shared<SourceBuffer>(source.data(), source.size());
+
+    ParserContext flex_ctx(buffer);
+    std::unique_ptr<Program> flex_prog(flex_ctx.parse());
+    REQUIRE(flex_prog);
+    CHECK(flex_prog->errors().empty());
+
+    ParserContext simd_ctx(buffer);
+    simd_ctx.set_scanner_type(ScannerType::SIMD);
+    std::unique_ptr<Program> simd_prog(simd_ctx.parse());
+    REQUIRE(simd_prog);
+    CHECK(simd_prog->errors().empty());
+    dump_errors(simd_prog->errors().begin(), simd_prog->errors().end());
+
+    CHECK(simd_prog->size() == 1 + 2 * 64 + 1);
+    check_same_sections(*simd_prog, *flex_prog);
+}
+
+class RecordingSink: public SectionSink
+{
+public:
+    std::vector<std::string> events;
+
+public:
+    void version(const location &location,
+                 unsigned int version,
+                 const std::string &profile,
+                 ProgramType type) override
+    {
+        events.emplace_back("version " + std::to_string(version) + " " + profile);
+    }
+
+    void source(const location &location, std::string_view text) override
+    {
+        events.emplace_back("source " + std::string(text));
+    }
+
+    void include(const location &location, const std::string &path) override
+    {
+        events.emplace_back("include " + path);
+    }
+
+    void error(const location &location, const std::string &msg) override
+    {
+        events.emplace_back("error");
+    }
+
+};
+
+TEST_CASE("parser/streaming/sections_in_order")
+{
+    std::istringstream data("#version 330 core fragment\n"
+                            "foo\n"
+                            "bar\n"
+                            "{% include \"baz\" %}\n"
+                            "{% include \"\\x\" %}");
+
+    ParserContext ctx(data);
+    RecordingSink sink;
+    CHECK(ctx.parse(sink));
+
+    std::vector<std::string> expected({
+        "version 330 core",
+        "source foo\n",
+        "source bar\n",
+        "include baz",
+        "source \n",
+        "error"
+    });
+    CHECK(sink.events == expected);
+}
+
+TEST_CASE("parser/streaming/from_buffer")
+{
+    static const char source[] = "#version 330 core\n"
+                                 "foo {% include \"bar\" %}";
+
+    auto buffer = std::make_shared<SourceBuffer>(source, sizeof(source)-1);
+    ParserContext ctx(buffer);
+    ctx.set_scanner_type(ScannerType::SIMD);
+    RecordingSink sink;
+    CHECK(ctx.parse(sink));
+
+    std::vector<std::string> expected({
+        "version 330 core",
+        "source foo ",
+        "include bar"
+    });
+    CHECK(sink.events == expected);
+}
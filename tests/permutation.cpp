@@ -0,0 +1,72 @@
+#include <catch.hpp>
+
+#include <stdexcept>
+
+#include "spp/spp.hpp"
+
+
+using namespace spp;
+
+TEST_CASE("permutation/matrix")
+{
+    PermutationMatrix matrix;
+    matrix.add_axis("SHADOWS", {"0", "1"});
+    matrix.add_axis("LIGHTS", {"1", "2", "4"});
+    CHECK_THROWS_AS(matrix.add_axis("LIGHTS", {"1"}), std::invalid_argument);
+    CHECK_THROWS_AS(matrix.add_axis("EMPTY", {}), std::invalid_argument);
+
+    auto all = matrix.permutations();
+    REQUIRE(all.size() == 6);
+    CHECK(all[0] == PermutationMatrix::Choice({0, 0}));
+    CHECK(all[1] == PermutationMatrix::Choice({0, 1}));
+    CHECK(all[3] == PermutationMatrix::Choice({1, 0}));
+    CHECK(all[5] == PermutationMatrix::Choice({1, 2}));
+
+    matrix.exclude([](const PermutationMatrix &m, const PermutationMatrix::Choice &choice) {
+        return m.value(choice, "SHADOWS") == "1" && m.value(choice, "LIGHTS") == "4";
+    });
+    auto filtered = matrix.permutations();
+    REQUIRE(filtered.size() == 5);
+    CHECK(filtered[4] == PermutationMatrix::Choice({1, 1}));
+}
+
+TEST_CASE("permutation/evaluate")
+{
+    std::istringstream data("#version 330 core\n"
+                            "void main() {}\n");
+    ParserContext pctx(data);
+    std::unique_ptr<Program> prog = pctx.parse();
+    REQUIRE(prog);
+
+    Library lib;
+    EvaluationContext base(lib);
+    base.define("BASE", "1");
+
+    PermutationMatrix matrix;
+    matrix.add_axis("SHADOWS", {"0", "1"});
+    matrix.add_axis("LIGHTS", {"1", "2", "4", "8"});
+    matrix.add_axis("SKINNED", {"0", "1"});
+
+    ThreadPool pool(4);
+    auto variants = evaluate_permutations(*prog, base, matrix, pool);
+    REQUIRE(variants.size() == 16);
+
+    auto choices = matrix.permutations();
+    for (std::size_t i = 0; i < variants.size(); ++i) {
+        const Variant &variant = variants[i];
+        CHECK(variant.choice == choices[i]);
+
+        EvaluationContext ctx(base);
+        ctx.define("SHADOWS", matrix.value(variant.choice, "SHADOWS"));
+        ctx.define("LIGHTS", matrix.value(variant.choice, "LIGHTS"));
+        ctx.define("SKINNED", matrix.value(variant.choice, "SKINNED"));
+        CHECK(variant.source == prog->plan().evaluate(ctx));
+    }
+
+    CHECK(variants[5].source == "#version 330 core\n"
+                                "#define BASE 1\n"
+                                "#define SHADOWS 0\n"
+                                "#define LIGHTS 4\n"
+                                "#define SKINNED 1\n"
+                                "void main() {}\n");
+}
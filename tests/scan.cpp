@@ -0,0 +1,86 @@
+#include <catch.hpp>
+
+#include <random>
+#include <string>
+
+#include "spp/scan.hpp"
+
+
+using namespace spp;
+
+
+static CodeScan reference_scan(const char *begin, const char *end)
+{
+    CodeScan result{end, 0, nullptr};
+    for (const char *p = begin; p < end; ++p) {
+        if (*p == '{' && p + 1 < end && p[1] == '%') {
+            result.stop = p;
+            return result;
+        }
+        if (*p == '\n') {
+            ++result.newlines;
+            result.last_newline = p;
+        }
+    }
+    return result;
+}
+
+
+TEST_CASE("scan_code/stops_at_directive")
+{
+    const std::string source("foo {bar}\nbaz\n{ {%x");
+    const char *begin = source.data();
+    const char *end = begin + source.size();
+
+    CodeScan scan = scan_code(begin, end);
+    CHECK(scan.stop - begin == 16);
+    CHECK(scan.newlines == 2);
+    REQUIRE(scan.last_newline);
+    CHECK(scan.last_newline - begin == 13);
+}
+
+TEST_CASE("scan_code/brace_at_end")
+{
+    const std::string source("foo\n{");
+    const char *begin = source.data();
+    const char *end = begin + source.size();
+
+    CodeScan scan = scan_code(begin, end);
+    CHECK(scan.stop == end);
+    CHECK(scan.newlines == 1);
+}
+
+TEST_CASE("scan_code/matches_reference")
+{
+    // exercise the vector loops and the tails at all block offsets
+    std::mt19937 rng(4242);
+    const char alphabet[] = {'a', '\n', '{', '%', ' '};
+    std::uniform_int_distribution<int> pick(0, sizeof(alphabet)-1);
+    const std::vector<CodeScanImpl> impls = supported_code_scans();
+    REQUIRE(std::string(impls.back().name) == "scalar");
+
+    for (unsigned int length = 0; length < 200; ++length) {
+        std::string source;
+        for (unsigned int i = 0; i < length; ++i) {
+            // keep directive openers rare so that long runs are scanned
+            char c = alphabet[pick(rng)];
+            if (c == '%' && !source.empty() && source.back() == '{' && rng() % 8 != 0) {
+                c = 'b';
+            }
+            source.push_back(c);
+        }
+
+        const char *begin = source.data();
+        const char *end = begin + source.size();
+        for (const char *start = begin; start <= end; start += 7) {
+            const CodeScan expected = reference_scan(start, end);
+            for (const CodeScanImpl &impl: impls) {
+                INFO(impl.name);
+                const CodeScan scan = impl.scan(start, end);
+                CHECK(scan.stop == expected.stop);
+                CHECK(scan.newlines == expected.newlines);
+                CHECK(scan.last_newline == expected.last_newline);
+            }
+        }
+    }
+}
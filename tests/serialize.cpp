@@ -0,0 +1,92 @@
+#include <catch.hpp>
+
+#include <stdexcept>
+
+#include "spp/spp.hpp"
+
+
+using namespace spp;
+
+TEST_CASE("serialize/round_trip")
+{
+    std::istringstream in("#version 330 core\n"
+                          "foo\n"
+                          "{% include \"bar.glsl\" %}\n"
+                          "baz\n");
+    ParserContext parser(in, "main.glsl");
+    std::unique_ptr<Program> prog = parser.parse();
+    REQUIRE(prog);
+    prog->add_local_error(location(), "some error");
+
+    ProgramManifest manifest;
+    manifest.settings = 42;
+    manifest.dependencies.push_back(ProgramDependency{"main.glsl", true, 1234});
+    manifest.dependencies.push_back(ProgramDependency{"bar.glsl", false, 0});
+    manifest.includes.emplace_back(0, 1);
+
+    auto buffer = std::make_shared<SourceBuffer>(serialize_program(*prog, manifest));
+    SerializedProgram serialized(buffer);
+
+    const ProgramManifest &read = serialized.manifest();
+    CHECK(read.settings == 42);
+    REQUIRE(read.dependencies.size() == 2);
+    CHECK(read.dependencies[0].path == "main.glsl");
+    CHECK(read.dependencies[0].present);
+    CHECK(read.dependencies[0].content_hash == 1234);
+    CHECK_FALSE(read.dependencies[1].present);
+    REQUIRE(read.includes.size() == 1);
+    CHECK(read.includes[0] == std::make_pair<std::uint32_t, std::uint32_t>(0, 1));
+
+    std::unique_ptr<Program> copy = serialized.deserialize(nullptr);
+    REQUIRE(copy);
+    CHECK(copy->source_path() == "main.glsl");
+    CHECK(copy->type() == prog->type());
+    REQUIRE(copy->errors().size() == 1);
+    CHECK(std::get<2>(copy->errors()[0]) == "some error");
+    REQUIRE(copy->size() == prog->size());
+    for (Program::size_type i = 0; i < prog->size(); ++i) {
+        const Section *expected = &(*prog)[i];
+        const Section *actual = &(*copy)[i];
+        CHECK(actual->kind() == expected->kind());
+        CHECK(actual->text() == expected->text());
+        CHECK(actual->version() == expected->version());
+        CHECK(actual->loc().begin.line == expected->loc().begin.line);
+        CHECK(actual->loc().end.column == expected->loc().end.column);
+        // the text is not copied out of the buffer
+        CHECK(actual->text().data() >= buffer->data());
+        CHECK(actual->text().data() < buffer->data() + buffer->size());
+    }
+}
+
+TEST_CASE("serialize/malformed")
+{
+    std::istringstream in("#version 330 core\n"
+                          "foo\n");
+    ParserContext parser(in, "main.glsl");
+    std::unique_ptr<Program> prog = parser.parse();
+    REQUIRE(prog);
+
+    ProgramManifest manifest;
+    manifest.settings = 0;
+    const std::string data = serialize_program(*prog, manifest);
+
+    SECTION("not a serialized program")
+    {
+        CHECK_THROWS_AS(SerializedProgram(std::make_shared<SourceBuffer>(std::string("#version 330\n"))),
+                        std::runtime_error);
+    }
+
+    SECTION("truncated")
+    {
+        for (std::size_t size = 0; size < data.size(); ++size) {
+            bool failed = false;
+            try {
+                SerializedProgram serialized(std::make_shared<SourceBuffer>(data.substr(0, size)));
+                serialized.deserialize(nullptr);
+            } catch (const std::runtime_error &) {
+                failed = true;
+            }
+            CHECK(failed);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#include <catch.hpp>
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include "spp/spp.hpp"
+
+
+using namespace spp;
+
+TEST_CASE("threadpool/parallel_for")
+{
+    for (unsigned int threads: {0u, 1u, 4u}) {
+        ThreadPool pool(threads);
+        std::vector<int> results(1000, 0);
+        pool.parallel_for(results.size(), [&results](std::size_t i) {
+            results[i] = static_cast<int>(i) * 2;
+        });
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            CHECK(results[i] == static_cast<int>(i) * 2);
+        }
+    }
+}
+
+TEST_CASE("threadpool/nested_parallel_for")
+{
+    ThreadPool pool(2);
+    std::atomic<int> calls(0);
+    pool.parallel_for(8, [&pool, &calls](std::size_t) {
+        pool.parallel_for(8, [&calls](std::size_t) {
+            ++calls;
+        });
+    });
+    CHECK(calls == 64);
+}
+
+TEST_CASE("threadpool/exception")
+{
+    ThreadPool pool(2);
+    CHECK_THROWS_AS(pool.parallel_for(16, [](std::size_t i) {
+                        if (i == 7) {
+                            throw std::runtime_error("fail");
+                        }
+                    }),
+                    std::runtime_error);
+}